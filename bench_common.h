@@ -0,0 +1,320 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include "rdma_client.h"
+#include "rdma_server.h"
+#include "latency_histogram.h"
+
+// 基准测试的公共部分：参数解析、服务端、同步与结果输出
+namespace RDMA_ECHO {
+namespace bench {
+
+// 服务端对数据消息的处理方式
+enum class ServeMode {
+    Echo,  // 原样发回，用于ping-pong
+    Sink,  // 丢弃，用于单向吞吐
+};
+
+// 客户端在一轮发送结束后发出SYNCMSG，服务端在其之前的消息全部取走后回复ACKMSG；
+// 数据消息均由'x'填充，不会与二者混淆
+const std::string SYNCMSG = "E";
+const std::string ACKMSG = "A";
+
+struct BenchFlags {
+    std::string role{"both"};         // both在同一进程中运行两端，server与client分别只运行一端
+    std::string addr{"127.0.0.1"};    // 服务端地址，Soft-RoCE下为绑定rxe设备的网卡地址
+    int port{22300};                  // 第i个队列深度使用port + i
+    std::string sizes{"8:1048576:4"}; // min:max:factor，按factor倍增且总包含max，或以逗号分隔的列表
+    std::string depths{"32,128,512"}; // 发送与接收队列深度，以逗号分隔
+    std::string threads{"1"};         // 发送线程数，以逗号分隔
+    uint32_t conns{1};                // 连接数，大于1时各线程按ThreadAffinity分散至各连接
+    uint64_t iters{100000};           // 每个消息长度的测量次数
+    uint64_t max_bytes{256 << 20};    // 每个消息长度的测量字节数上限，大消息的测量次数随之减少
+    std::string format{"json"};       // json每行一个对象，csv带表头
+    std::string out;                  // 结果文件，为空时写入标准输出
+};
+
+struct BenchResult {
+    const char* bench;
+    uint32_t size;
+    uint32_t depth;
+    uint32_t threads;
+    uint32_t conns;
+    uint64_t msgs;
+    uint64_t elapsed_ns;
+    const char* latency_kind;  // rtt为往返时间，send为SendMessage调用的耗时
+    LatencySnapshot latency;
+    uint64_t desc_stalls;      // 测量期间Send描述符不足的次数
+    uint64_t credit_stalls;    // 测量期间credit不足的次数
+};
+
+inline void Fail(const char* what) {
+    std::fprintf(stderr, "bench: %s\n", what);
+    std::exit(1);
+}
+
+inline std::vector<uint64_t> ParseList(const std::string& spec) {
+    std::vector<uint64_t> values;
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos) end = spec.size();
+        values.push_back(std::strtoull(spec.c_str() + pos, nullptr, 10));
+        pos = end + 1;
+    }
+    return values;
+}
+
+inline std::vector<uint64_t> ParseSizes(const std::string& spec) {
+    if (spec.find(':') == std::string::npos) {
+        return ParseList(spec);
+    }
+    uint64_t min = 0, max = 0, factor = 2;
+    if (std::sscanf(spec.c_str(), "%lu:%lu:%lu", &min, &max, &factor) < 2 || min == 0 || factor < 2) {
+        Fail("invalid --sizes");
+    }
+    std::vector<uint64_t> sizes;
+    for (uint64_t size = min; size < max; size *= factor) {
+        sizes.push_back(size);
+    }
+    sizes.push_back(max);
+    return sizes;
+}
+
+// 解析--key=value形式的参数，未知参数时打印用法并退出
+inline BenchFlags ParseFlags(int argc, char** argv, BenchFlags flags) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string key = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--role") flags.role = value;
+        else if (key == "--addr") flags.addr = value;
+        else if (key == "--port") flags.port = std::atoi(value.c_str());
+        else if (key == "--sizes") flags.sizes = value;
+        else if (key == "--depths") flags.depths = value;
+        else if (key == "--threads") flags.threads = value;
+        else if (key == "--conns") flags.conns = std::atoi(value.c_str());
+        else if (key == "--iters") flags.iters = std::strtoull(value.c_str(), nullptr, 10);
+        else if (key == "--max_bytes") flags.max_bytes = std::strtoull(value.c_str(), nullptr, 10);
+        else if (key == "--format") flags.format = value;
+        else if (key == "--out") flags.out = value;
+        else {
+            std::fprintf(stderr,
+                "usage: %s [--role=both|server|client] [--addr=%s] [--port=%d] [--sizes=%s] [--depths=%s]\n"
+                "          [--threads=%s] [--conns=%u] [--iters=%lu] [--max_bytes=%lu] [--format=json|csv] [--out=FILE]\n",
+                argv[0], flags.addr.c_str(), flags.port, flags.sizes.c_str(), flags.depths.c_str(),
+                flags.threads.c_str(), flags.conns, flags.iters, flags.max_bytes);
+            std::exit(1);
+        }
+    }
+    if (flags.role != "both" && flags.role != "server" && flags.role != "client") Fail("invalid --role");
+    if (flags.format != "json" && flags.format != "csv") Fail("invalid --format");
+    if (flags.conns == 0 || flags.iters == 0) Fail("--conns and --iters must be positive");
+    return flags;
+}
+
+// 两端须使用相同的队列深度：发送深度决定Send描述符数量，接收深度决定对端的credit
+inline RDMAProxyOptions MakeOptions(uint32_t depth) {
+    RDMAProxyOptions options;
+    options.send_wr_depth = depth;
+    options.recv_wr_depth = depth;
+    options.arena_max_chunks = 64;   // 深队列下的大消息需要更多的发送缓冲区
+    options.log_terminal = false;    // 标准输出只用于结果
+    return options;
+}
+
+// 每个消息长度的测量次数，至少16次
+inline uint64_t Iterations(const BenchFlags& flags, uint64_t size) {
+    return std::max<uint64_t>(std::min<uint64_t>(flags.iters, flags.max_bytes / size), 16);
+}
+
+// 发送SYNCMSG并等待ACKMSG，此时此前发送的消息均已被对端取走
+inline void Sync(RDMAProxy* proxy) {
+    if (proxy->SendMessage(SYNCMSG)) Fail("send sync");
+    std::string msg;
+    do {
+        if (proxy->RecvMessage(msg)) Fail("wait ack");
+    } while (msg != ACKMSG);
+}
+
+inline void Serve(RDMAProxy* proxy, ServeMode mode) {
+    std::string msg;
+    while (proxy->RecvMessage(msg) == 0) {
+        if (msg == SYNCMSG) {
+            proxy->SendMessage(ACKMSG);
+        } else if (mode == ServeMode::Echo) {
+            proxy->SendMessage(msg);
+        }
+    }
+}
+
+// 接受conns个连接并分别服务，直至对端全部断开
+inline void ServeConnections(RDMAServer* server, uint32_t conns, ServeMode mode) {
+    std::vector<std::unique_ptr<RDMAProxy>> proxies;
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < conns; i++) {
+        proxies.push_back(server->Accept());
+        if (!proxies.back()) Fail("accept");
+        threads.emplace_back(&Serve, proxies.back().get(), mode);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+inline void SumStalls(RDMAProxyGroup* group, uint64_t* desc_stalls, uint64_t* credit_stalls) {
+    *desc_stalls = 0;
+    *credit_stalls = 0;
+    for (size_t i = 0; i < group->Size(); i++) {
+        ProxyStats stats = group->At(i)->GetStats();
+        *desc_stalls += stats.send_desc_stalls;
+        *credit_stalls += stats.credit_stalls;
+    }
+}
+
+class ResultWriter {
+  public:
+    explicit ResultWriter(const BenchFlags& flags) : csv_(flags.format == "csv") {
+        f_ = flags.out.empty() ? stdout : std::fopen(flags.out.c_str(), "w");
+        if (f_ == nullptr) Fail("open --out");
+    }
+    ~ResultWriter() {
+        if (f_ != stdout) std::fclose(f_);
+    }
+    ResultWriter(const ResultWriter&) = delete;
+    ResultWriter& operator=(const ResultWriter&) = delete;
+
+    void Write(const BenchResult& r) {
+        double seconds = r.elapsed_ns / 1e9;
+        double msgs_per_sec = seconds > 0 ? r.msgs / seconds : 0;
+        double gbps = msgs_per_sec * r.size * 8 / 1e9;
+        if (csv_) {
+            if (!header_) {
+                std::fprintf(f_, "bench,size,depth,threads,conns,msgs,seconds,msgs_per_sec,gbps,latency_kind,"
+                                 "lat_mean_ns,lat_p50_ns,lat_p99_ns,lat_p999_ns,lat_max_ns,desc_stalls,credit_stalls\n");
+                header_ = true;
+            }
+            std::fprintf(f_, "%s,%u,%u,%u,%u,%lu,%.6f,%.1f,%.4f,%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+                r.bench, r.size, r.depth, r.threads, r.conns, r.msgs, seconds, msgs_per_sec, gbps, r.latency_kind,
+                r.latency.mean, r.latency.p50, r.latency.p99, r.latency.p999, r.latency.max,
+                r.desc_stalls, r.credit_stalls);
+        } else {
+            std::fprintf(f_, "{\"bench\":\"%s\",\"size\":%u,\"depth\":%u,\"threads\":%u,\"conns\":%u,\"msgs\":%lu,"
+                             "\"seconds\":%.6f,\"msgs_per_sec\":%.1f,\"gbps\":%.4f,\"latency_kind\":\"%s\","
+                             "\"lat_mean_ns\":%lu,\"lat_p50_ns\":%lu,\"lat_p99_ns\":%lu,\"lat_p999_ns\":%lu,\"lat_max_ns\":%lu,"
+                             "\"desc_stalls\":%lu,\"credit_stalls\":%lu}\n",
+                r.bench, r.size, r.depth, r.threads, r.conns, r.msgs, seconds, msgs_per_sec, gbps, r.latency_kind,
+                r.latency.mean, r.latency.p50, r.latency.p99, r.latency.p999, r.latency.max,
+                r.desc_stalls, r.credit_stalls);
+        }
+        std::fflush(f_);
+    }
+
+  private:
+    std::FILE* f_;
+    bool csv_;
+    bool header_{false};
+};
+
+// 由threads个线程经group共发送n条size字节的消息，再经每个连接同步以确认对端已全部取走，
+// 返回的结果中latency为SendMessage调用的耗时，即发送方因描述符、缓冲区或credit不足而等待的时间
+inline BenchResult Stream(RDMAProxyGroup* group, uint32_t threads, uint64_t size, uint64_t n,
+                          LatencyHistogram* histogram) {
+    histogram->Reset();
+    BenchResult result = {};
+    uint64_t desc_stalls, credit_stalls;
+    SumStalls(group, &desc_stalls, &credit_stalls);
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> senders;
+    uint64_t start = MonotonicNs();
+    for (uint32_t t = 0; t < threads; t++) {
+        uint64_t count = n / threads + (t < n % threads ? 1 : 0);
+        senders.emplace_back([group, size, count, histogram, &failed] {
+            std::string msg(size, 'x');
+            for (uint64_t i = 0; i < count && !failed; i++) {
+                uint64_t begin = MonotonicNs();
+                if (group->SendMessage(msg)) {
+                    failed = true;
+                }
+                histogram->Record(MonotonicNs() - begin);
+            }
+        });
+    }
+    for (auto& sender : senders) {
+        sender.join();
+    }
+    if (failed) Fail("send");
+    for (size_t i = 0; i < group->Size(); i++) {
+        Sync(group->At(i));
+    }
+    result.elapsed_ns = MonotonicNs() - start;
+    SumStalls(group, &result.desc_stalls, &result.credit_stalls);
+    result.desc_stalls -= desc_stalls;
+    result.credit_stalls -= credit_stalls;
+    result.size = size;
+    result.threads = threads;
+    result.conns = group->Size();
+    result.msgs = n;
+    result.latency_kind = "send";
+    result.latency = histogram->Snapshot();
+    return result;
+}
+
+// 每个端口的日志写入各自的文件
+inline std::string LogFile(const char* role, int port) {
+    return std::string("bench_") + role + "." + std::to_string(port) + ".log";
+}
+
+// 对每个队列深度建立一组连接并调用run；role为both时服务端在同一进程的后台线程中运行，
+// 为server时只服务，对端须以相同的--depths与--conns运行
+inline void RunDepths(const BenchFlags& flags, ServeMode mode,
+                      const std::function<void(RDMAProxyGroup* group, uint32_t depth)>& run) {
+    std::vector<uint64_t> depths = ParseList(flags.depths);
+    if (flags.role == "server") {
+        // 预先监听所有端口，对端切换队列深度时无需等待服务端就绪
+        std::vector<std::unique_ptr<RDMAServer>> servers;
+        for (size_t i = 0; i < depths.size(); i++) {
+            servers.emplace_back(new RDMAServer(LogFile("server", flags.port + i), MakeOptions(depths[i])));
+            if (servers.back()->BindAndListen(flags.port + i)) Fail("listen");
+        }
+        for (auto& server : servers) {
+            ServeConnections(server.get(), flags.conns, mode);
+        }
+        return;
+    }
+    for (size_t i = 0; i < depths.size(); i++) {
+        uint32_t depth = depths[i];
+        int port = flags.port + i;
+        RDMAProxyOptions options = MakeOptions(depth);
+        std::unique_ptr<RDMAServer> server;
+        std::thread server_thread;
+        if (flags.role == "both") {
+            server.reset(new RDMAServer(LogFile("server", port), options));
+            if (server->BindAndListen(port)) Fail("listen");
+            server_thread = std::thread(&ServeConnections, server.get(), flags.conns, mode);
+        }
+        RDMAClient client(LogFile("client", port), options);
+        std::unique_ptr<RDMAProxyGroup> group = client.ConnectGroup(flags.addr, std::to_string(port), flags.conns);
+        if (!group) Fail("connect");
+        run(group.get(), depth);
+        group->Disconnect();
+        if (server_thread.joinable()) {
+            server_thread.join();
+        }
+    }
+}
+
+}
+}
+#endif
@@ -0,0 +1,30 @@
+#include "bench_common.h"
+
+using namespace RDMA_ECHO;
+
+// 多线程发送：对每个线程数分别测量吞吐，--conns为1时所有线程共享一个QP，
+// 否则线程按ThreadAffinity分散至各连接，可比较两者随线程数的扩展
+int main(int argc, char** argv) {
+    bench::BenchFlags defaults;
+    defaults.threads = "1,2,4,8";
+    defaults.sizes = "8:65536:8";
+    defaults.depths = "128";
+    bench::BenchFlags flags = bench::ParseFlags(argc, argv, defaults);
+    bench::ResultWriter writer(flags);
+    std::vector<uint64_t> sizes = bench::ParseSizes(flags.sizes);
+    std::vector<uint64_t> threads = bench::ParseList(flags.threads);
+    bench::RunDepths(flags, bench::ServeMode::Sink, [&](RDMAProxyGroup* group, uint32_t depth) {
+        std::unique_ptr<LatencyHistogram> histogram(new LatencyHistogram());
+        for (uint64_t size : sizes) {
+            uint64_t n = bench::Iterations(flags, size);
+            for (uint64_t t : threads) {
+                if (t == 0) bench::Fail("--threads must be positive");
+                bench::Stream(group, t, size, n / 10 + 1, histogram.get());
+                bench::BenchResult result = bench::Stream(group, t, size, n, histogram.get());
+                result.bench = "multithread";
+                result.depth = depth;
+                writer.Write(result);
+            }
+        }
+    });
+}
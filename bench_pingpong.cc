@@ -0,0 +1,52 @@
+#include "bench_common.h"
+
+using namespace RDMA_ECHO;
+
+// ping-pong延迟：客户端发送一条消息并等待服务端原样发回，记录每次往返的时间
+int main(int argc, char** argv) {
+    bench::BenchFlags defaults;
+    defaults.iters = 10000;
+    defaults.max_bytes = 64 << 20;
+    bench::BenchFlags flags = bench::ParseFlags(argc, argv, defaults);
+    // 往返之间没有其他消息，只使用一个连接与一个线程
+    flags.conns = 1;
+    bench::ResultWriter writer(flags);
+    std::vector<uint64_t> sizes = bench::ParseSizes(flags.sizes);
+    bench::RunDepths(flags, bench::ServeMode::Echo, [&](RDMAProxyGroup* group, uint32_t depth) {
+        RDMAProxy* proxy = group->At(0);
+        std::unique_ptr<LatencyHistogram> histogram(new LatencyHistogram());
+        for (uint64_t size : sizes) {
+            uint64_t n = bench::Iterations(flags, size);
+            std::string msg(size, 'x');
+            std::string reply;
+            // 预热，并使接收缓冲区与发送内存区域增长至稳定状态
+            for (uint64_t i = 0; i < n / 10 + 1; i++) {
+                if (proxy->SendMessage(msg) || proxy->RecvMessage(reply)) bench::Fail("warmup");
+            }
+            histogram->Reset();
+            bench::BenchResult result = {};
+            uint64_t desc_stalls, credit_stalls;
+            bench::SumStalls(group, &desc_stalls, &credit_stalls);
+            uint64_t start = MonotonicNs();
+            for (uint64_t i = 0; i < n; i++) {
+                uint64_t begin = MonotonicNs();
+                if (proxy->SendMessage(msg) || proxy->RecvMessage(reply)) bench::Fail("ping-pong");
+                histogram->Record(MonotonicNs() - begin);
+            }
+            result.elapsed_ns = MonotonicNs() - start;
+            if (reply.size() != size) bench::Fail("echo size mismatch");
+            bench::SumStalls(group, &result.desc_stalls, &result.credit_stalls);
+            result.desc_stalls -= desc_stalls;
+            result.credit_stalls -= credit_stalls;
+            result.bench = "pingpong";
+            result.size = size;
+            result.depth = depth;
+            result.threads = 1;
+            result.conns = 1;
+            result.msgs = n;
+            result.latency_kind = "rtt";
+            result.latency = histogram->Snapshot();
+            writer.Write(result);
+        }
+    });
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+# 在单机上通过Soft-RoCE(rxe)运行全部基准测试，需要root权限与rdma_rxe内核模块
+# usage: bazel build -c opt //:bench_pingpong //:bench_stream //:bench_multithread && sudo ./bench_rxe.sh [netdev] [outdir]
+#   未指定netdev时创建veth对rbench0/rbench1，rxe绑定于rbench0并连接其自身地址(由rxe在设备内回环)
+#   结果以JSON Lines写入outdir/{pingpong,stream,multithread}.jsonl，其余参数可由BENCH_ARGS传入
+set -e
+
+NETDEV=$1
+OUTDIR=$(realpath -m "${2:-bench_results}")
+# 默认使用在仓库根目录下以bazel build -c opt构建的二进制
+BIN_DIR=$(realpath "${BIN_DIR:-bazel-bin}")
+
+if [ -z "$NETDEV" ]; then
+    NETDEV=rbench0
+    if ! ip link show "$NETDEV" > /dev/null 2>&1; then
+        ip link add rbench0 type veth peer name rbench1
+        ip addr add 10.77.0.1/24 dev rbench0
+    fi
+    ip link set rbench0 up
+    ip link set rbench1 up
+fi
+ADDR=$(ip -4 -o addr show dev "$NETDEV" | awk '{print $4}' | cut -d/ -f1 | head -n 1)
+if [ -z "$ADDR" ]; then
+    echo "no IPv4 address on $NETDEV" >&2
+    exit 1
+fi
+
+modprobe rdma_rxe
+if ! rdma link show | grep -q "netdev $NETDEV\b"; then
+    rdma link add "rxe_$NETDEV" type rxe netdev "$NETDEV"
+fi
+# 内存区域按chunk注册，需要足够的锁定内存
+ulimit -l unlimited
+
+mkdir -p "$OUTDIR"
+cd "$OUTDIR"
+for bench in pingpong stream multithread; do
+    echo "running bench_$bench on $NETDEV ($ADDR)" >&2
+    "$BIN_DIR/bench_$bench" --addr="$ADDR" --out="$OUTDIR/$bench.jsonl" $BENCH_ARGS
+done
@@ -0,0 +1,23 @@
+#include "bench_common.h"
+
+using namespace RDMA_ECHO;
+
+// 单向吞吐：客户端连续发送，服务端只接收，以最后的同步消息确认全部送达
+int main(int argc, char** argv) {
+    bench::BenchFlags flags = bench::ParseFlags(argc, argv, bench::BenchFlags());
+    bench::ResultWriter writer(flags);
+    std::vector<uint64_t> sizes = bench::ParseSizes(flags.sizes);
+    // 单线程，--threads仅取第一个值，多线程的扫描见bench_multithread
+    uint32_t threads = std::max<uint64_t>(bench::ParseList(flags.threads)[0], 1);
+    bench::RunDepths(flags, bench::ServeMode::Sink, [&](RDMAProxyGroup* group, uint32_t depth) {
+        std::unique_ptr<LatencyHistogram> histogram(new LatencyHistogram());
+        for (uint64_t size : sizes) {
+            uint64_t n = bench::Iterations(flags, size);
+            bench::Stream(group, threads, size, n / 10 + 1, histogram.get());
+            bench::BenchResult result = bench::Stream(group, threads, size, n, histogram.get());
+            result.bench = "stream";
+            result.depth = depth;
+            writer.Write(result);
+        }
+    });
+}
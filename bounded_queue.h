@@ -0,0 +1,98 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+namespace RDMA_ECHO {
+
+// 定长的无锁多生产者多消费者队列，每个槽位以序号标识其是否可写或可读
+template <typename T>
+class BoundedQueue {
+  public:
+    // 容量向上取整为2的幂次
+    explicit BoundedQueue(size_t capacity) {
+        size_t sz = 2;
+        while (sz < capacity) sz <<= 1;
+        cells_.reset(new Cell[sz]);
+        mask_ = sz - 1;
+        for (size_t i = 0; i < sz; i++) {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // 队列已满时返回false
+    bool TryPush(const T& value) {
+        Cell* cell;
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = value;
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 队列为空时返回false
+    bool TryPop(T& value) {
+        Cell* cell;
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->data;
+        cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 近似的元素数量
+    size_t Size() const {
+        size_t enqueue = enqueue_pos_.load(std::memory_order_relaxed);
+        size_t dequeue = dequeue_pos_.load(std::memory_order_relaxed);
+        return enqueue > dequeue ? enqueue - dequeue : 0;
+    }
+
+    size_t Capacity() const { return mask_ + 1; }
+
+  private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        T data;
+    };
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_{0};
+    // 生产者与消费者的位置分处不同缓存行
+    char pad0_[64];
+    std::atomic<size_t> enqueue_pos_{0};
+    char pad1_[64];
+    std::atomic<size_t> dequeue_pos_{0};
+    char pad2_[64];
+};
+
+}
+#endif
@@ -0,0 +1,104 @@
+#include "bounded_queue.h"
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+using RDMA_ECHO::BoundedQueue;
+
+TEST(BoundedQueueTest, CapacityRoundsUp) {
+    EXPECT_EQ(BoundedQueue<int>(1).Capacity(), 2);
+    EXPECT_EQ(BoundedQueue<int>(5).Capacity(), 8);
+    EXPECT_EQ(BoundedQueue<int>(64).Capacity(), 64);
+}
+
+TEST(BoundedQueueTest, FullAndEmpty) {
+    BoundedQueue<int> queue(8);
+    int value = -1;
+    EXPECT_FALSE(queue.TryPop(value));
+    for (int i = 0; i < 8; i++) {
+        EXPECT_TRUE(queue.TryPush(i));
+    }
+    EXPECT_FALSE(queue.TryPush(8));
+    EXPECT_EQ(queue.Size(), 8);
+    for (int i = 0; i < 8; i++) {
+        EXPECT_TRUE(queue.TryPop(value));
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_FALSE(queue.TryPop(value));
+    EXPECT_EQ(queue.Size(), 0);
+}
+
+TEST(BoundedQueueTest, Wrap) {
+    // 位置多次越过容量后，槽位序号仍能区分可写与可读
+    BoundedQueue<int> queue(4);
+    int next_push = 0;
+    int next_pop = 0;
+    int value = -1;
+    for (int round = 0; round < 1000; round++) {
+        int n = round % 4 + 1;
+        for (int i = 0; i < n; i++) {
+            EXPECT_TRUE(queue.TryPush(next_push++));
+        }
+        if (n == 4) {
+            EXPECT_FALSE(queue.TryPush(next_push));
+        }
+        for (int i = 0; i < n; i++) {
+            EXPECT_TRUE(queue.TryPop(value));
+            EXPECT_EQ(value, next_pop++);
+        }
+        EXPECT_FALSE(queue.TryPop(value));
+    }
+}
+
+TEST(BoundedQueueTest, ConcurrentProducersConsumers) {
+    const int kProducers = 4;
+    const int kConsumers = 4;
+    const uint64_t kPerProducer = 200000;
+    // 容量较小，使生产者与消费者频繁遇到满与空
+    BoundedQueue<uint64_t> queue(16);
+    std::atomic<uint64_t> popped{0};
+    std::atomic<int> out_of_order{0};
+    std::vector<std::atomic<uint64_t>> received(kProducers);
+    for (auto& r : received) r = 0;
+
+    std::vector<std::thread> threads;
+    for (int p = 0; p < kProducers; p++) {
+        threads.emplace_back([&, p] {
+            for (uint64_t seq = 0; seq < kPerProducer; seq++) {
+                while (!queue.TryPush(((uint64_t)p << 32) | seq)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int c = 0; c < kConsumers; c++) {
+        threads.emplace_back([&] {
+            // 同一生产者的元素对任一消费者而言按序出现
+            std::vector<int64_t> last(kProducers, -1);
+            uint64_t value;
+            while (popped.load() < kProducers * kPerProducer) {
+                if (!queue.TryPop(value)) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                popped.fetch_add(1);
+                int p = value >> 32;
+                int64_t seq = (uint32_t)value;
+                if (seq <= last[p]) out_of_order++;
+                last[p] = seq;
+                received[p].fetch_add(1);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(out_of_order.load(), 0);
+    for (int p = 0; p < kProducers; p++) {
+        EXPECT_EQ(received[p].load(), kPerProducer);
+    }
+    uint64_t value;
+    EXPECT_FALSE(queue.TryPop(value));
+}
@@ -1,6 +1,5 @@
 #include "rdma_client.h"
 #include "rdma_proxy.h"
-#include <unistd.h>
 #include <vector>
 #include <iostream>
 
@@ -24,7 +23,7 @@ int main() {
     for (int i = 0; i < 3; i++) {
         threads[i].join();
     }
-    sleep(3);
+    proxy->Flush();
     proxy->Disconnect();
     std::cout << "DONE\n";
 }
\ No newline at end of file
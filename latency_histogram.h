@@ -0,0 +1,118 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+namespace RDMA_ECHO {
+
+// 单调时钟的纳秒数
+inline uint64_t MonotonicNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 直方图在某一时刻的统计，延迟均以纳秒计
+struct LatencySnapshot {
+    uint64_t count{0};
+    uint64_t mean{0};
+    uint64_t p50{0};
+    uint64_t p99{0};
+    uint64_t p999{0};
+    uint64_t max{0};
+};
+
+// 对数线性分桶的延迟直方图：每个2的幂次区间再均分为16个子桶，相对误差不超过1/16；
+// 记录与读取均无锁，读取期间并发的记录可能只被部分计入
+class LatencyHistogram {
+  public:
+    static constexpr int kSubBits = 4;
+    static constexpr size_t kSubBuckets = 1 << kSubBits;
+    static constexpr size_t kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+    LatencyHistogram() { Reset(); }
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    inline void Record(uint64_t ns) {
+        counts_[BucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+    }
+
+    LatencySnapshot Snapshot() const {
+        LatencySnapshot snapshot;
+        uint64_t counts[kBuckets];
+        uint64_t total = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            counts[i] = counts_[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+        if (total == 0) {
+            return snapshot;
+        }
+        snapshot.count = total;
+        snapshot.mean = sum_.load(std::memory_order_relaxed) / std::max<uint64_t>(count_.load(std::memory_order_relaxed), 1);
+        snapshot.max = max_.load(std::memory_order_relaxed);
+        // 桶的上界可能超过实际的最大值
+        snapshot.p50 = std::min(Percentile(counts, total, 0.5), snapshot.max);
+        snapshot.p99 = std::min(Percentile(counts, total, 0.99), snapshot.max);
+        snapshot.p999 = std::min(Percentile(counts, total, 0.999), snapshot.max);
+        return snapshot;
+    }
+
+    void Reset() {
+        for (size_t i = 0; i < kBuckets; i++) {
+            counts_[i].store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    // 小于16的值各占一个桶，其余按最高位所在的幂次与其后4位分桶
+    static inline size_t BucketOf(uint64_t ns) {
+        if (ns < kSubBuckets) {
+            return ns;
+        }
+        int exp = 63 - __builtin_clzll(ns);
+        return (exp - kSubBits + 1) * kSubBuckets + ((ns >> (exp - kSubBits)) & (kSubBuckets - 1));
+    }
+
+    // 桶内的最大值
+    static inline uint64_t UpperOf(size_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        int exp = bucket / kSubBuckets + kSubBits - 1;
+        uint64_t sub = bucket % kSubBuckets;
+        return ((kSubBuckets + sub + 1) << (exp - kSubBits)) - 1;
+    }
+
+  private:
+    static uint64_t Percentile(const uint64_t* counts, uint64_t total, double p) {
+        uint64_t rank = (uint64_t)(p * total);
+        if (rank >= total) rank = total - 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += counts[i];
+            if (seen > rank) {
+                return UpperOf(i);
+            }
+        }
+        return UpperOf(kBuckets - 1);
+    }
+
+    std::atomic<uint64_t> counts_[kBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+}
+#endif
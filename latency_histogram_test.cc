@@ -0,0 +1,90 @@
+#include "latency_histogram.h"
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <limits>
+
+using RDMA_ECHO::LatencyHistogram;
+using RDMA_ECHO::LatencySnapshot;
+
+TEST(LatencyHistogramTest, SmallValuesHaveOwnBucket) {
+    for (uint64_t v = 0; v < LatencyHistogram::kSubBuckets; v++) {
+        EXPECT_EQ(LatencyHistogram::BucketOf(v), v);
+        EXPECT_EQ(LatencyHistogram::UpperOf(v), v);
+    }
+    EXPECT_EQ(LatencyHistogram::BucketOf(16), 16);
+    EXPECT_EQ(LatencyHistogram::BucketOf(31), 31);
+    EXPECT_EQ(LatencyHistogram::BucketOf(32), 32);
+    EXPECT_EQ(LatencyHistogram::BucketOf(33), 32);
+}
+
+TEST(LatencyHistogramTest, BucketBoundaries) {
+    // 每个桶的上界落在本桶，上界加一落在下一个桶
+    for (size_t b = 0; b + 1 < LatencyHistogram::kBuckets; b++) {
+        uint64_t upper = LatencyHistogram::UpperOf(b);
+        EXPECT_EQ(LatencyHistogram::BucketOf(upper), b);
+        EXPECT_EQ(LatencyHistogram::BucketOf(upper + 1), b + 1);
+    }
+    uint64_t max = std::numeric_limits<uint64_t>::max();
+    EXPECT_EQ(LatencyHistogram::BucketOf(max), LatencyHistogram::kBuckets - 1);
+    EXPECT_EQ(LatencyHistogram::UpperOf(LatencyHistogram::kBuckets - 1), max);
+}
+
+TEST(LatencyHistogramTest, RelativeError) {
+    for (size_t b = LatencyHistogram::kSubBuckets; b < LatencyHistogram::kBuckets; b++) {
+        uint64_t lower = LatencyHistogram::UpperOf(b - 1) + 1;
+        uint64_t upper = LatencyHistogram::UpperOf(b);
+        EXPECT_LE(upper - lower, lower / LatencyHistogram::kSubBuckets);
+    }
+}
+
+TEST(LatencyHistogramTest, EmptySnapshot) {
+    LatencyHistogram histogram;
+    LatencySnapshot s = histogram.Snapshot();
+    EXPECT_EQ(s.count, 0);
+    EXPECT_EQ(s.p50, 0);
+    EXPECT_EQ(s.max, 0);
+}
+
+TEST(LatencyHistogramTest, Percentile) {
+    LatencyHistogram histogram;
+    for (uint64_t v = 1; v <= 1000; v++) {
+        histogram.Record(v);
+    }
+    LatencySnapshot s = histogram.Snapshot();
+    EXPECT_EQ(s.count, 1000);
+    EXPECT_EQ(s.mean, 500);
+    EXPECT_EQ(s.max, 1000);
+    // 百分位数取所在桶的上界，不小于真实值且误差不超过1/16
+    EXPECT_GE(s.p50, 500);
+    EXPECT_LE(s.p50, 500 + 500 / 16);
+    EXPECT_GE(s.p99, 990);
+    EXPECT_LE(s.p99, 1000);
+    EXPECT_GE(s.p999, 999);
+    EXPECT_LE(s.p999, 1000);
+}
+
+TEST(LatencyHistogramTest, PercentileClampedToMax) {
+    LatencyHistogram histogram;
+    // 1000所在桶的上界大于1000
+    ASSERT_GT(LatencyHistogram::UpperOf(LatencyHistogram::BucketOf(1000)), 1000);
+    histogram.Record(1000);
+    LatencySnapshot s = histogram.Snapshot();
+    EXPECT_EQ(s.p50, 1000);
+    EXPECT_EQ(s.p99, 1000);
+    EXPECT_EQ(s.p999, 1000);
+}
+
+TEST(LatencyHistogramTest, Reset) {
+    LatencyHistogram histogram;
+    histogram.Record(5);
+    histogram.Record(100000);
+    histogram.Reset();
+    LatencySnapshot s = histogram.Snapshot();
+    EXPECT_EQ(s.count, 0);
+    EXPECT_EQ(s.max, 0);
+    histogram.Record(7);
+    s = histogram.Snapshot();
+    EXPECT_EQ(s.count, 1);
+    EXPECT_EQ(s.p50, 7);
+    EXPECT_EQ(s.max, 7);
+}
@@ -1,16 +1,169 @@
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
 
 #include "logger.h"
 
 namespace RDMA_ECHO {
 
+namespace {
+
+// 每个线程只格式化一次自身的id
+const char* ThreadName() {
+    thread_local std::string name = [] {
+        std::ostringstream thread_stream;
+        thread_stream << std::this_thread::get_id();
+        return thread_stream.str();
+    }();
+    return name.c_str();
+}
+
+}
+
+FileLogger::FileLogger(std::FILE* f, bool show_terminal, bool async)
+    : f_(f), show_terminal_(show_terminal) {
+    if (async) {
+        queue_.reset(new BoundedQueue<LogRecord>(LOGQUEUESIZE));
+        writer_ = std::thread(&FileLogger::WriteLoop, this);
+    }
+}
+
+FileLogger::~FileLogger() {
+    stop_ = true;
+    if (writer_.joinable()) {
+        writer_.join();
+    }
+    std::fclose(f_);
+}
+
+int FileLogger::FormatPrefix(char* buffer, size_t size, std::time_t time, const char* thread) {
+    // localtime非线程安全，且每秒只需转换一次
+    thread_local std::time_t cached_time = -1;
+    thread_local struct tm local_time;
+    if (time != cached_time) {
+        localtime_r(&time, &local_time);
+        cached_time = time;
+    }
+    return std::snprintf(buffer, size,
+        "thread[%s]: %04d-%02d-%02d %02d:%02d:%02d ",
+        thread,
+        local_time.tm_year + 1900,
+        local_time.tm_mon + 1,
+        local_time.tm_mday,
+        local_time.tm_hour,
+        local_time.tm_min,
+        local_time.tm_sec);
+}
+
+void FileLogger::LogV(const char* format, std::va_list ap) {
+    LogV(LogLevel::Info, format, ap);
+}
+
+void FileLogger::LogV(LogLevel level, const char* format, std::va_list ap) {
+    if (!Enabled(level)) {
+        return;
+    }
+    std::time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    if (queue_) {
+        LogRecord record;
+        record.time = now;
+        std::snprintf(record.thread, sizeof(record.thread), "%s", ThreadName());
+        int n = std::vsnprintf(record.text, sizeof(record.text), format, ap);
+        record.len = n < 0 ? 0 : std::min<uint32_t>(n, sizeof(record.text) - 1);
+        if (!queue_->TryPush(record)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            dropped_total_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return;
+    }
+    constexpr const int BufferSize = 512;
+    char buffer[BufferSize];
+    int prefix = FormatPrefix(buffer, BufferSize, now, ThreadName());
+    std::va_list arguments_copy;
+    va_copy(arguments_copy, ap);
+    int n = std::vsnprintf(buffer + prefix, BufferSize - prefix, format, arguments_copy);
+    va_end(arguments_copy);
+    if (n < 0) {
+        return;
+    }
+    if (prefix + n >= BufferSize - 1) {
+        // 正文过长时在堆上重新格式化，保留换行符的空间
+        std::vector<char> new_buffer(prefix + n + 2);
+        memcpy(new_buffer.data(), buffer, prefix);
+        va_copy(arguments_copy, ap);
+        std::vsnprintf(new_buffer.data() + prefix, n + 1, format, arguments_copy);
+        va_end(arguments_copy);
+        new_buffer[prefix + n] = '\n';
+        WriteLog(new_buffer.data(), prefix + n + 1);
+        return;
+    }
+    buffer[prefix + n] = '\n';
+    WriteLog(buffer, prefix + n + 1);
+}
+
+void FileLogger::WriteLog(const char* buffer, size_t size) {
+    std::fwrite(buffer, 1, size, f_);
+    if (!queue_) {
+        std::fflush(f_);
+    }
+    if (show_terminal_) {
+        std::fwrite(buffer, 1, size, stdout);
+    }
+}
+
+void FileLogger::WriteLoop() {
+    constexpr size_t BatchSize = 256;
+    std::vector<char> out;
+    out.reserve(BatchSize * 128);
+    LogRecord record;
+    char prefix[96];
+    while (true) {
+        bool stop = stop_.load();
+        size_t n = 0;
+        while (n < BatchSize && queue_->TryPop(record)) {
+            int len = FormatPrefix(prefix, sizeof(prefix), record.time, record.thread);
+            out.insert(out.end(), prefix, prefix + len);
+            out.insert(out.end(), record.text, record.text + record.len);
+            out.push_back('\n');
+            n++;
+        }
+        uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            int len = std::snprintf(prefix, sizeof(prefix), "FileLogger dropped %lu records\n", dropped);
+            out.insert(out.end(), prefix, prefix + len);
+        }
+        if (!out.empty()) {
+            // 每批只写入并fflush一次
+            WriteLog(out.data(), out.size());
+            std::fflush(f_);
+            out.clear();
+        }
+        if (n == 0) {
+            if (stop) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
 void Log(FileLogger* logger, const char* format, ...) {
-    if (logger != nullptr) {
+    if (logger != nullptr && logger->Enabled(LogLevel::Info)) {
         std::va_list ap;
         va_start(ap, format);
-        logger->LogV(format, ap);
+        logger->LogV(LogLevel::Info, format, ap);
         va_end(ap);
     }
 }
 
+void LogAt(FileLogger* logger, LogLevel level, const char* format, ...) {
+    if (logger != nullptr && logger->Enabled(level)) {
+        std::va_list ap;
+        va_start(ap, format);
+        logger->LogV(level, format, ap);
+        va_end(ap);
+    }
 }
 
+}
@@ -4,14 +4,36 @@
 #include <cstdarg>
 #include <cstdio>
 #include <thread>
+#include <atomic>
 #include <chrono>
 #include <ctime>
+#include <memory>
 #include <sstream>
 #include <cassert>
 #include <iostream>
 
+#include "bounded_queue.h"
+
+// 编译期的最低日志级别，0至3依次对应Debug、Info、Warn、Error，可通过-DRDMA_MIN_LOG_LEVEL=0开启逐消息的日志
+#ifndef RDMA_MIN_LOG_LEVEL
+#define RDMA_MIN_LOG_LEVEL 1
+#endif
+
 namespace RDMA_ECHO {
 
+enum class LogLevel : int {
+    Debug = 0,  // 逐消息的收发细节
+    Info = 1,
+    Warn = 2,
+    Error = 3,
+};
+
+// 低于该级别的LogDebug等调用在编译期被消除，连同参数的格式化
+constexpr LogLevel MINLOGLEVEL = static_cast<LogLevel>(RDMA_MIN_LOG_LEVEL);
+
+constexpr size_t LOGRECORDSIZE = 256;   // 异步模式下单条日志正文的上限，超出部分被截断
+constexpr size_t LOGQUEUESIZE = 8192;   // 异步模式下待写入的日志条数上限，队列满时丢弃并计数
+
 class Logger {
   public:
     explicit Logger() = default;
@@ -24,82 +46,63 @@ class Logger {
 
 class FileLogger : public Logger {
   public:
-    explicit FileLogger(std::FILE* f, bool show_terminal) 
-        : f_(f), show_terminal_(show_terminal) {}
-    ~FileLogger() override {
-        std::fclose(f_);
-    }
-    void LogV(const char* format, std::va_list ap) override {
-        constexpr const int BufferSize = 512;
-        char buffer[BufferSize];
-
-        auto now = std::chrono::system_clock::now();
-        std::time_t now_time = std::chrono::system_clock::to_time_t(now);
-        struct tm *local_time = ::localtime(&now_time);
-
-        std::ostringstream thread_stream;
-        thread_stream << std::this_thread::get_id();
-        std::string thread_id = thread_stream.str();
-        int buffer_idx = std::snprintf(buffer, BufferSize,
-            "thread[%s]: %04d-%02d-%02d %02d:%02d:%02d ",
-            thread_id.c_str(),
-            local_time->tm_year + 1900,
-            local_time->tm_mon + 1,
-            local_time->tm_mday,
-            local_time->tm_hour,
-            local_time->tm_min,
-            local_time->tm_sec);
-
-        std::va_list arguments_copy;
-        va_copy(arguments_copy, ap);
-        buffer_idx +=
-            std::vsnprintf(buffer + buffer_idx, BufferSize - buffer_idx,
-                            format, arguments_copy);
-        va_end(arguments_copy);
-
-        if (buffer_idx >= BufferSize - 1) {
-            char* new_buffer = new char[buffer_idx + 2];
-            buffer_idx = std::snprintf(buffer, BufferSize,
-                "thread[%s]: %04d-%02d-%02d %02d:%02d:%02d ",
-                thread_id.c_str(),
-                local_time->tm_year + 1900,
-                local_time->tm_mon + 1,
-                local_time->tm_mday,
-                local_time->tm_hour,
-                local_time->tm_min,
-                local_time->tm_sec);
-            std::va_list arguments_copy;
-            va_copy(arguments_copy, ap);
-            buffer_idx +=
-                std::vsnprintf(new_buffer + buffer_idx, BufferSize - buffer_idx,
-                                format, arguments_copy);
-            va_end(arguments_copy);
-            WriteLog(buffer, buffer_idx);
-            delete[] new_buffer;
-            return;
-        }
-        WriteLog(buffer, buffer_idx);
-    }
+    // async为true时调用方仅格式化正文并写入无锁队列，由后台线程补全时间与线程前缀后批量写入并fflush
+    explicit FileLogger(std::FILE* f, bool show_terminal, bool async = false);
+    ~FileLogger() override;
+
+    // 以Info级别记录
+    void LogV(const char* format, std::va_list ap) override;
+
+    void LogV(LogLevel level, const char* format, std::va_list ap);
+
+    // 运行时的最低日志级别，不低于MINLOGLEVEL时才有意义
+    inline void SetLevel(LogLevel level) { level_.store(level, std::memory_order_relaxed); }
+    inline bool Enabled(LogLevel level) const { return level >= level_.load(std::memory_order_relaxed); }
+
+    // 异步模式下因队列已满而丢弃的日志条数
+    inline uint64_t Dropped() const { return dropped_total_.load(std::memory_order_relaxed); }
+
   private:
-    void WriteLog(char* buffer, int size) {
-        if (buffer[size] != '\n') {
-            buffer[size] = '\n';
-            ++size;
-        }
-        std::fwrite(buffer, 1, size, f_);
-        std::fflush(f_);
-        if (show_terminal_) {
-            std::fwrite(buffer, 1, size, stdout);
-        }
-    }
+    struct LogRecord {
+        std::time_t time;
+        char thread[32];  // 记录所属线程可能先于写入退出，故拷贝其名称
+        uint32_t len;
+        char text[LOGRECORDSIZE];
+    };
+
+    // 写入"thread[id]: yyyy-mm-dd hh:mm:ss "，返回写入的长度
+    static int FormatPrefix(char* buffer, size_t size, std::time_t time, const char* thread);
+
+    // 后台线程：批量取出日志并写入
+    void WriteLoop();
+
+    void WriteLog(const char* buffer, size_t size);
+
     std::FILE* f_;
     bool show_terminal_;
+    std::atomic<LogLevel> level_{MINLOGLEVEL};
+    std::unique_ptr<BoundedQueue<LogRecord>> queue_;  // 仅异步模式
+    std::atomic<uint64_t> dropped_{0};        // 尚未在日志中报告的丢弃条数
+    std::atomic<uint64_t> dropped_total_{0};
+    std::atomic<bool> stop_{false};
+    std::thread writer_;
 };
 
+// 以Info级别记录，logger为nullptr时忽略
 void Log(FileLogger* logger, const char* format, ...);
 
+void LogAt(FileLogger* logger, LogLevel level, const char* format, ...);
+
+// 逐消息的日志，MINLOGLEVEL高于Debug时整个调用在编译期被消除
+template <typename... Args>
+inline void LogDebug(FileLogger* logger, const char* format, Args... args) {
+    if (MINLOGLEVEL <= LogLevel::Debug) {
+        LogAt(logger, LogLevel::Debug, format, args...);
+    }
+}
+
 }
 
 
 
-#endif
\ No newline at end of file
+#endif
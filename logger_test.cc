@@ -0,0 +1,95 @@
+#include "logger.h"
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// 读取日志文件，返回正文行与丢弃报告中的条数之和
+void ReadLog(const char* path, std::vector<std::string>* lines, uint64_t* reported_drops) {
+    std::ifstream in(path);
+    std::string line;
+    *reported_drops = 0;
+    while (std::getline(in, line)) {
+        unsigned long dropped = 0;
+        if (std::sscanf(line.c_str(), "FileLogger dropped %lu records", &dropped) == 1) {
+            *reported_drops += dropped;
+            continue;
+        }
+        lines->push_back(line);
+    }
+}
+
+}
+
+TEST(LoggerTest, AsyncDrainsOnDestruction) {
+    const char* path = "logger_test.log";
+    const int kRecords = 1000;
+    uint64_t dropped = 0;
+    {
+        RDMA_ECHO::FileLogger logger(std::fopen(path, "w"), false, true);
+        for (int i = 0; i < kRecords; i++) {
+            RDMA_ECHO::Log(&logger, "record %d", i);
+        }
+        dropped = logger.Dropped();
+    }
+    // 未超过队列容量时不应丢弃，析构返回前写出全部记录
+    EXPECT_EQ(dropped, 0);
+    std::vector<std::string> lines;
+    uint64_t reported = 0;
+    ReadLog(path, &lines, &reported);
+    EXPECT_EQ(reported, 0);
+    ASSERT_EQ(lines.size(), kRecords);
+    for (int i = 0; i < kRecords; i++) {
+        std::string suffix = "record " + std::to_string(i);
+        ASSERT_GE(lines[i].size(), suffix.size());
+        EXPECT_EQ(lines[i].substr(lines[i].size() - suffix.size()), suffix);
+    }
+}
+
+TEST(LoggerTest, AsyncCountsDrops) {
+    const char* path = "logger_test.log";
+    const int kThreads = 4;
+    const int kPerThread = 4 * RDMA_ECHO::LOGQUEUESIZE;
+    uint64_t dropped = 0;
+    {
+        RDMA_ECHO::FileLogger logger(std::fopen(path, "w"), false, true);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < kThreads; t++) {
+            threads.emplace_back([&logger, t] {
+                for (int i = 0; i < kPerThread; i++) {
+                    RDMA_ECHO::Log(&logger, "thread %d record %d", t, i);
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        dropped = logger.Dropped();
+    }
+    // 写入的记录与丢弃的记录恰好构成全部记录，且丢弃数量全部在日志中报告
+    std::vector<std::string> lines;
+    uint64_t reported = 0;
+    ReadLog(path, &lines, &reported);
+    EXPECT_EQ(lines.size() + dropped, (uint64_t)kThreads * kPerThread);
+    EXPECT_EQ(reported, dropped);
+}
+
+TEST(LoggerTest, LevelFilter) {
+    const char* path = "logger_test.log";
+    {
+        RDMA_ECHO::FileLogger logger(std::fopen(path, "w"), false, true);
+        logger.SetLevel(RDMA_ECHO::LogLevel::Warn);
+        RDMA_ECHO::Log(&logger, "info");
+        RDMA_ECHO::LogAt(&logger, RDMA_ECHO::LogLevel::Error, "error");
+    }
+    std::vector<std::string> lines;
+    uint64_t reported = 0;
+    ReadLog(path, &lines, &reported);
+    ASSERT_EQ(lines.size(), 1);
+    EXPECT_NE(lines[0].find("error"), std::string::npos);
+}
@@ -1,81 +1,260 @@
 #include "mr_manager.h"
 
+#include <sys/mman.h>
+#include <algorithm>
+
 namespace RDMA_ECHO {
 
+namespace {
+
+// 小于等于n的最大2的幂次的指数
+int FloorLog2(size_t n) {
+    int order = 0;
+    while (((size_t)1 << (order + 1)) <= n) order++;
+    return order;
+}
+
+// wr_id的散列，用于开放寻址表
+inline size_t HashWrId(uint64_t wr_id) {
+    return (size_t)(wr_id * 0x9E3779B97F4A7C15ULL >> 16);
+}
+
+// 当前线程的序号，用于选择线程缓存
+uint32_t ThreadIndex() {
+    static std::atomic<uint32_t> next_index{0};
+    thread_local uint32_t index = next_index.fetch_add(1);
+    return index;
+}
+
+}
+
+constexpr size_t MRManager::kMinBlockSize;
+constexpr int MRManager::kMaxOrders;
+constexpr uint8_t MRManager::kFreeFlag;
+constexpr uint8_t MRManager::kNotHead;
+constexpr size_t MRManager::kMaxChunks;
+constexpr size_t MRManager::kHugePageSize;
+constexpr uint64_t MRManager::kAddrKey;
+constexpr int MRManager::kMaxCachedOrder;
+constexpr int MRManager::kThreadCaches;
+constexpr uint32_t MRManager::kRefillBatch;
+constexpr uint32_t MRManager::kCacheLimit;
+
 MRManager::~MRManager() {
     Log(logger_.get(), "~MRManager()");
-    if(mr_) ibv_dereg_mr(mr_);
-    delete[] buffer_;
-    for (MemBlock* block = free_list_head_.next; block != nullptr; block = block->next) {
+    ReleaseChunks();
+    ClearBlocks();
+}
+
+void MRManager::ReleaseChunks() {
+    size_t count = chunk_count_.load();
+    for (size_t i = 0; i < count; i++) {
+        MRChunk& chunk = chunks_[i];
+        if (chunk.mr) ibv_dereg_mr(chunk.mr);
+        if (chunk.mapped) {
+            munmap(chunk.addr, chunk.sz);
+        } else {
+            delete[] chunk.addr;
+        }
+        chunk = MRChunk();
+    }
+    chunk_count_ = 0;
+}
+
+void MRManager::ClearBlocks() {
+    MemBlock* block = free_list_head_.next;
+    while (block != nullptr) {
+        MemBlock* next = block->next;
         delete block;
+        block = next;
     }
-    for (MemBlock* block = used_list_head_.next; block != nullptr; block = block->next) {
+    block = used_list_head_.next;
+    while (block != nullptr) {
+        MemBlock* next = block->next;
         delete block;
+        block = next;
     }
+    free_list_head_.next = nullptr;
+    used_list_head_.next = nullptr;
+    used_blocks_.clear();
+
+    caches_.reset();
+    for (int order = 0; order <= kMaxCachedOrder; order++) {
+        returned_[order].store(nullptr);
+    }
+    for (int order = 0; order < kMaxOrders; order++) {
+        free_heads_[order] = nullptr;
+        free_counts_[order] = 0;
+    }
+    parked_bytes_ = 0;
+    pool_out_bytes_ = 0;
+    units_ = 0;
+    used_slots_.clear();
+    used_slot_mask_ = 0;
+    used_slot_count_ = 0;
+    used_bytes_ = 0;
+    requested_bytes_ = 0;
 }
 
 int MRManager::DeregisterMR() {
     int ret = 0;
     std::unique_lock<std::mutex> lock(mtx_);
-    delete[] buffer_;
-    for (MemBlock* block = free_list_head_.next; block != nullptr; block = block->next) {
-        delete block;
-    }
-    for (MemBlock* block = used_list_head_.next; block != nullptr; block = block->next) {
-        delete block;
+    size_t count = chunk_count_.load();
+    for (size_t i = 0; i < count; i++) {
+        if (chunks_[i].mr && ibv_dereg_mr(chunks_[i].mr)) ret = -1;
+        chunks_[i].mr = nullptr;
     }
-    if(mr_) ret = ibv_dereg_mr(mr_);
-    mr_ = nullptr;
-    buffer_ = nullptr;
-    free_list_head_.next = nullptr;
-    used_list_head_.next = nullptr;
+    ReleaseChunks();
+    ClearBlocks();
     return ret;
 }
 
 int MRManager::RegisterMR(ibv_pd* pd, char* buffer, size_t buffer_sz) {
     std::unique_lock<std::mutex> lock(mtx_);
-    if (mr_ != nullptr) {
+    if (chunk_count_.load() != 0) {
+        Log(logger_.get(), "MR has been register");
+        return -1;
+    }
+    pd_ = pd;
+    chunk_sz_ = buffer_sz;
+    max_chunks_ = 1;
+    use_hugepage_ = false;
+    return AddChunk(buffer, buffer_sz, false, false);
+}
+
+int MRManager::RegisterArena(ibv_pd* pd, size_t chunk_sz, size_t max_chunks, bool use_hugepage) {
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (chunk_count_.load() != 0) {
         Log(logger_.get(), "MR has been register");
         return -1;
     }
-    buffer_ = buffer;
-    buffer_sz_ = buffer_sz;
-    mr_ = ibv_reg_mr(pd, buffer, buffer_sz, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
-    if (mr_ == nullptr) {
+    pd_ = pd;
+    // 大页chunk的大小须为大页的整数倍
+    if (use_hugepage) {
+        chunk_sz = (chunk_sz + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+    }
+    chunk_sz_ = chunk_sz;
+    // FirstFit的有序空闲链表只管理单个chunk
+    max_chunks_ = policy_ == AllocPolicy::FirstFit ? 1 : std::min(std::max<size_t>(max_chunks, 1), kMaxChunks);
+    use_hugepage_ = use_hugepage;
+    return Grow(chunk_sz_);
+}
+
+int MRManager::Grow(size_t sz) {
+    if (chunk_count_.load() >= max_chunks_ || pd_ == nullptr) {
+        return -1;
+    }
+    char* addr = nullptr;
+    bool hugepage = false;
+    if (use_hugepage_) {
+        void* ptr = mmap(nullptr, sz, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            addr = (char*)ptr;
+            hugepage = true;
+        } else {
+            Log(logger_.get(), "MRManager mmap hugepage Fail(%s), fallback to normal pages", strerror(errno));
+        }
+    }
+    if (addr == nullptr) {
+        void* ptr = mmap(nullptr, sz, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            Log(logger_.get(), "MRManager mmap Fail(%s)", strerror(errno));
+            return -1;
+        }
+        addr = (char*)ptr;
+        // 退回普通页时尽量使用透明大页
+        if (use_hugepage_) madvise(addr, sz, MADV_HUGEPAGE);
+    }
+    if (AddChunk(addr, sz, true, hugepage)) {
+        munmap(addr, sz);
+        return -1;
+    }
+    Log(logger_.get(), "MRManager Grow: chunk %lu, %lu bytes, hugepage %d",
+        chunk_count_.load(), sz, hugepage);
+    return 0;
+}
+
+int MRManager::AddChunk(char* addr, size_t sz, bool mapped, bool hugepage) {
+    if (!chunks_) {
+        chunks_.reset(new MRChunk[kMaxChunks]);
+    }
+    size_t index = chunk_count_.load();
+    MRChunk& chunk = chunks_[index];
+    // 原子操作只作用于RegisterMemory注册的应用内存，arena不开放远程原子访问
+    chunk.mr = ibv_reg_mr(pd_, addr, sz, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                                         IBV_ACCESS_REMOTE_READ);
+    if (chunk.mr == nullptr) {
         Log(logger_.get(), "MRManager reg_mr Fail(%s)", strerror(errno));
         return -1;
     }
+    chunk.addr = addr;
+    chunk.sz = sz;
+    chunk.mapped = mapped;
+    chunk.hugepage = hugepage;
+
+    if (policy_ == AllocPolicy::FirstFit) {
+        MemBlock* block = new MemBlock(addr, sz);
+        //Log(logger_.get(), "MemBlock new %lu", block);
+        free_list_head_.next = block;
+        block->prev = &free_list_head_;
+        chunk_count_.store(index + 1, std::memory_order_release);
+        return 0;
+    }
 
-    MemBlock* block = new MemBlock(buffer, buffer_sz);
-    //Log(logger_.get(), "MemBlock new %lu", block);
-    free_list_head_.next = block;
-    block->prev = &free_list_head_;
+    chunk.units = sz / kMinBlockSize;
+    chunk.max_order = chunk.units == 0 ? 0 : std::min(FloorLog2(chunk.units), kMaxOrders - 1);
+    chunk.unit_order.reset(new uint8_t[chunk.units]);
+    memset(chunk.unit_order.get(), kNotHead, chunk.units);
+    chunk.unit_requested.reset(new uint32_t[chunk.units]());
+    if (policy_ == AllocPolicy::ThreadCache && !caches_) {
+        caches_.reset(new ThreadCacheBin[kThreadCaches]);
+    }
+    // 将chunk按从大到小的2的幂次切分，每个初始块都按自身大小对齐
+    size_t unit = 0;
+    for (int order = chunk.max_order; order >= 0; order--) {
+        if (unit + ((size_t)1 << order) <= chunk.units) {
+            PushFree(&chunk, unit, order);
+            unit += (size_t)1 << order;
+        }
+    }
+    units_ += chunk.units;
+    ResizeUsedSlots(units_);
+    chunk_count_.store(index + 1, std::memory_order_release);
     return 0;
 }
 
+MRManager::MRChunk* MRManager::FindChunk(const char* addr) const {
+    size_t count = chunk_count_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+        MRChunk* chunk = &chunks_[i];
+        if (addr >= chunk->addr && addr < chunk->addr + chunk->sz) {
+            return chunk;
+        }
+    }
+    return nullptr;
+}
+
+uint32_t MRManager::LKey(const char* addr) const {
+    MRChunk* chunk = FindChunk(addr);
+    return chunk ? chunk->mr->lkey : 0;
+}
+
+uint32_t MRManager::RKey(const char* addr) const {
+    MRChunk* chunk = FindChunk(addr);
+    return chunk ? chunk->mr->rkey : 0;
+}
+
 std::unique_ptr<SendWRWrapper> MRManager::AllocateSendWR(uint64_t wr_id, const std::string& msg) {
     std::unique_lock<std::mutex> lock(mtx_);
     uint32_t buffer_size = msg.size() + 1;
-    for (MemBlock* block = free_list_head_.next; block != nullptr; block = block->next) {
-        if (block->sz >= buffer_size) {
-            MemBlock* used_block = new MemBlock(block->addr, buffer_size);
-            //Log(logger_.get(), "MemBlock new %lu", used_block);
-            used_blocks_[wr_id] = used_block;
-            InsertBlock(used_block, &used_list_head_, false);
-            if (block->sz > buffer_size) {
-                block->addr = block->addr + buffer_size;
-                block->sz = block->sz - buffer_size;
-            } else {
-                RemoveBlock(block);
-                delete block;
-            }
-            memcpy(used_block->addr, msg.c_str(), buffer_size);
-            used_block->addr[buffer_size] = '\0';
-            return ConstructSendMR(wr_id, used_block->addr, buffer_size);
-        }
+    char* addr = AllocateBlock(wr_id, buffer_size);
+    if (addr == nullptr) {
+        return nullptr;
     }
-    Log(logger_.get(), "No avaiable block for %lu size", buffer_size);
-    return nullptr;
+    memcpy(addr, msg.c_str(), buffer_size);
+    return ConstructSendMR(wr_id, addr, buffer_size);
 }
 
 std::unique_ptr<SendWRWrapper> MRManager::ConstructSendMR(uint64_t wr_id, char *addr, uint32_t sz) {
@@ -91,31 +270,18 @@ std::unique_ptr<SendWRWrapper> MRManager::ConstructSendMR(uint64_t wr_id, char *
 
     sge->addr = (uintptr_t)addr;
     sge->length = sz;
-    std::string msg(addr, sz);
-    sge->lkey = mr_->lkey;
+    sge->lkey = LKey(addr);
     return std::unique_ptr<SendWRWrapper>(new SendWRWrapper(wr, sge));
 }
 
 std::unique_ptr<RecvWRWrapper> MRManager::AllocateRecvWR(uint64_t wr_id, uint32_t buffer_size) {
     std::unique_lock<std::mutex> lock(mtx_);
-    for (MemBlock* block = free_list_head_.next; block != nullptr; block = block->next) {
-        if (block->sz >= buffer_size) {
-            MemBlock* used_block = new MemBlock(block->addr, buffer_size);
-            used_blocks_[wr_id] = used_block;
-            InsertBlock(used_block, &used_list_head_, false);
-            if (block->sz > buffer_size) {
-                block->addr = block->addr + buffer_size;
-                block->sz = block->sz - buffer_size;
-            } else {
-                RemoveBlock(block);
-                delete block;
-            }
-            return ConstructRecvMR(wr_id, used_block->addr, buffer_size);
-        }
+    char* addr = AllocateBlock(wr_id, buffer_size);
+    if (addr == nullptr) {
+        //PrintBlock();
+        return nullptr;
     }
-    Log(logger_.get(), "No avaiable block for %lu size", buffer_size);
-    //PrintBlock();
-    return nullptr;
+    return ConstructRecvMR(wr_id, addr, buffer_size);
 }
 
 std::unique_ptr<RecvWRWrapper> MRManager::ConstructRecvMR(uint64_t wr_id, char *addr, uint32_t sz) {
@@ -129,19 +295,496 @@ std::unique_ptr<RecvWRWrapper> MRManager::ConstructRecvMR(uint64_t wr_id, char *
 
     sge->addr = (uintptr_t)addr;
     sge->length = sz;
-    sge->lkey = mr_->lkey;
+    sge->lkey = LKey(addr);
     return std::unique_ptr<RecvWRWrapper>(new RecvWRWrapper(wr, sge, addr, sz));
 }
 
-
-
 void MRManager::ReleaseMR(uint64_t wr_id) {
     std::unique_lock<std::mutex> lock(mtx_);
-    MemBlock* block = used_blocks_[wr_id];
+    if (policy_ != AllocPolicy::FirstFit) {
+        SizeClassRelease(wr_id);
+    } else {
+        FirstFitRelease(wr_id);
+    }
+}
+
+char* MRManager::AllocateBlock(uint64_t wr_id, uint32_t sz) {
+    char* addr = nullptr;
+    if (chunk_count_.load() != 0) {
+        addr = policy_ != AllocPolicy::FirstFit ? SizeClassAllocate(wr_id, sz)
+                                                : FirstFitAllocate(wr_id, sz);
+    }
+    if (addr == nullptr) {
+        alloc_fail_count_++;
+        Log(logger_.get(), "No avaiable block for %lu size", sz);
+        return nullptr;
+    }
+    alloc_count_++;
+    requested_bytes_ += sz;
+    return addr;
+}
+
+char* MRManager::FirstFitAllocate(uint64_t wr_id, uint32_t sz) {
+    for (MemBlock* block = free_list_head_.next; block != nullptr; block = block->next) {
+        if (block->sz >= sz) {
+            MemBlock* used_block = new MemBlock(block->addr, sz);
+            //Log(logger_.get(), "MemBlock new %lu", used_block);
+            // 按地址分配的块以地址作为键
+            used_blocks_[wr_id == kAddrKey ? (uint64_t)(uintptr_t)block->addr : wr_id] = used_block;
+            InsertBlock(used_block, &used_list_head_, false);
+            if (block->sz > sz) {
+                block->addr = block->addr + sz;
+                block->sz = block->sz - sz;
+            } else {
+                RemoveBlock(block);
+                delete block;
+            }
+            used_bytes_ += sz;
+            return used_block->addr;
+        }
+    }
+    return nullptr;
+}
+
+void MRManager::FirstFitRelease(uint64_t wr_id) {
+    auto iter = used_blocks_.find(wr_id);
+    if (iter == used_blocks_.end()) {
+        Log(logger_.get(), "ReleaseMR unknown wr_id %lu", wr_id);
+        return;
+    }
+    MemBlock* block = iter->second;
+    used_blocks_.erase(iter);
+    used_bytes_ -= block->sz;
+    requested_bytes_ -= block->sz;
+    release_count_++;
     RemoveBlock(block);
     InsertBlock(block, &free_list_head_, true);
 }
 
+void MRManager::ResizeUsedSlots(size_t units) {
+    // 表容量不小于块数上限的两倍，保证开放寻址的探测长度较短
+    size_t slots = 1;
+    while (slots < units * 2) slots <<= 1;
+    if (slots <= used_slots_.size()) return;
+    std::vector<UsedSlot> old_slots;
+    old_slots.swap(used_slots_);
+    used_slots_.assign(slots, UsedSlot{0, nullptr, 0, false});
+    used_slot_mask_ = slots - 1;
+    for (const UsedSlot& slot : old_slots) {
+        if (!slot.valid) continue;
+        size_t idx = HashWrId(slot.wr_id) & used_slot_mask_;
+        while (used_slots_[idx].valid) idx = (idx + 1) & used_slot_mask_;
+        used_slots_[idx] = slot;
+    }
+}
+
+void MRManager::PushFree(MRChunk* chunk, size_t unit, int order) {
+    FreeNode* node = reinterpret_cast<FreeNode*>(chunk->addr + unit * kMinBlockSize);
+    node->prev = nullptr;
+    node->next = free_heads_[order];
+    if (node->next) node->next->prev = node;
+    free_heads_[order] = node;
+    free_counts_[order]++;
+    chunk->unit_order[unit] = (uint8_t)order | kFreeFlag;
+}
+
+void MRManager::RemoveFree(FreeNode* node, int order) {
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        free_heads_[order] = node->next;
+    }
+    if (node->next) node->next->prev = node->prev;
+    free_counts_[order]--;
+}
+
+char* MRManager::SizeClassAllocate(uint64_t wr_id, uint32_t sz) {
+    char* addr = PoolAllocate(OrderOf(sz));
+    if (addr == nullptr) {
+        return nullptr;
+    }
+    size_t idx = HashWrId(wr_id) & used_slot_mask_;
+    while (used_slots_[idx].valid) idx = (idx + 1) & used_slot_mask_;
+    used_slots_[idx] = UsedSlot{wr_id, addr, sz, true};
+    used_slot_count_++;
+    used_bytes_ += kMinBlockSize << OrderOf(sz);
+    return addr;
+}
+
+void MRManager::SizeClassRelease(uint64_t wr_id) {
+    UsedSlot* slot = FindUsedSlot(wr_id);
+    if (slot == nullptr) {
+        Log(logger_.get(), "ReleaseMR unknown wr_id %lu", wr_id);
+        return;
+    }
+    char* addr = slot->addr;
+    MRChunk* chunk = FindChunk(addr);
+    requested_bytes_ -= slot->requested;
+    used_bytes_ -= kMinBlockSize << chunk->unit_order[UnitOf(chunk, addr)];
+    release_count_++;
+    EraseUsedSlot(slot);
+    used_slot_count_--;
+    BuddyFree(addr);
+}
+
+char* MRManager::PoolAllocate(int order) {
+    char* addr = BuddyAllocate(order);
+    if (addr == nullptr && policy_ == AllocPolicy::ThreadCache) {
+        DrainReturned();
+        addr = BuddyAllocate(order);
+    }
+    // 当前chunk耗尽时注册新的chunk，超过chunk大小的块独占一个与其等大的chunk
+    size_t grow_sz = std::max(chunk_sz_, (size_t)kMinBlockSize << order);
+    while (addr == nullptr && Grow(grow_sz) == 0) {
+        addr = BuddyAllocate(order);
+    }
+    return addr;
+}
+
+char* MRManager::BuddyAllocate(int order) {
+    if (order >= kMaxOrders) {
+        return nullptr;
+    }
+    int k = order;
+    while (k < kMaxOrders && free_heads_[k] == nullptr) k++;
+    if (k == kMaxOrders) {
+        return nullptr;
+    }
+    FreeNode* node = free_heads_[k];
+    RemoveFree(node, k);
+    MRChunk* chunk = FindChunk(reinterpret_cast<char*>(node));
+    size_t unit = UnitOf(chunk, reinterpret_cast<char*>(node));
+    // 逐级拆分，将后半部分放回对应级别的空闲链表
+    while (k > order) {
+        k--;
+        PushFree(chunk, unit + ((size_t)1 << k), k);
+    }
+    chunk->unit_order[unit] = (uint8_t)order;
+    pool_out_bytes_ += kMinBlockSize << order;
+    return chunk->addr + unit * kMinBlockSize;
+}
+
+void MRManager::BuddyFree(char* addr) {
+    MRChunk* chunk = FindChunk(addr);
+    size_t unit = UnitOf(chunk, addr);
+    int order = chunk->unit_order[unit];
+    pool_out_bytes_ -= kMinBlockSize << order;
+    // 与同一chunk内的伙伴块逐级合并
+    while (order < chunk->max_order) {
+        size_t buddy = unit ^ ((size_t)1 << order);
+        if (buddy + ((size_t)1 << order) > chunk->units ||
+            chunk->unit_order[buddy] != ((uint8_t)order | kFreeFlag)) {
+            break;
+        }
+        RemoveFree(reinterpret_cast<FreeNode*>(chunk->addr + buddy * kMinBlockSize), order);
+        chunk->unit_order[std::max(unit, buddy)] = kNotHead;
+        unit = std::min(unit, buddy);
+        order++;
+    }
+    PushFree(chunk, unit, order);
+}
+
+void MRManager::DrainReturned() {
+    for (int order = 0; order <= kMaxCachedOrder; order++) {
+        FreeNode* node = returned_[order].exchange(nullptr, std::memory_order_acquire);
+        while (node != nullptr) {
+            FreeNode* next = node->next;
+            parked_bytes_.fetch_sub(kMinBlockSize << order, std::memory_order_relaxed);
+            BuddyFree(reinterpret_cast<char*>(node));
+            node = next;
+        }
+    }
+}
+
+char* MRManager::AllocateBuffer(uint32_t sz) {
+    if (sz == 0) sz = 1;
+    int order = OrderOf(sz);
+    ThreadCacheBin* cache = nullptr;
+    if (policy_ == AllocPolicy::ThreadCache && order <= kMaxCachedOrder) {
+        cache = AcquireCache();
+    }
+    if (cache == nullptr) {
+        // 未启用线程缓存或缓存被占用时访问共享池
+        std::unique_lock<std::mutex> lock(mtx_);
+        char* addr = nullptr;
+        if (chunk_count_.load() != 0) {
+            addr = policy_ == AllocPolicy::FirstFit ? FirstFitAllocate(kAddrKey, sz) : PoolAllocate(order);
+        }
+        if (addr == nullptr) {
+            alloc_fail_count_++;
+            Log(logger_.get(), "No avaiable block for %lu size", sz);
+            return nullptr;
+        }
+        if (policy_ != AllocPolicy::FirstFit) {
+            MRChunk* chunk = FindChunk(addr);
+            chunk->unit_requested[UnitOf(chunk, addr)] = sz;
+        }
+        alloc_count_++;
+        requested_bytes_ += sz;
+        used_bytes_ += policy_ == AllocPolicy::FirstFit ? sz : kMinBlockSize << order;
+        return addr;
+    }
+    if (cache->heads[order] == nullptr) {
+        RefillCache(cache, order);
+    }
+    FreeNode* node = cache->heads[order];
+    if (node == nullptr) {
+        cache->busy.store(false, std::memory_order_release);
+        std::unique_lock<std::mutex> lock(mtx_);
+        alloc_fail_count_++;
+        Log(logger_.get(), "No avaiable block for %lu size", sz);
+        return nullptr;
+    }
+    cache->heads[order] = node->next;
+    cache->counts[order]--;
+    char* addr = reinterpret_cast<char*>(node);
+    MRChunk* chunk = FindChunk(addr);
+    chunk->unit_requested[UnitOf(chunk, addr)] = sz;
+    cache->alloc_count.store(cache->alloc_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    cache->alloc_bytes.store(cache->alloc_bytes.load(std::memory_order_relaxed) + (kMinBlockSize << order),
+                             std::memory_order_relaxed);
+    cache->requested_bytes.store(cache->requested_bytes.load(std::memory_order_relaxed) + sz,
+                                 std::memory_order_relaxed);
+    cache->busy.store(false, std::memory_order_release);
+    return addr;
+}
+
+void MRManager::ReleaseBuffer(char* addr) {
+    if (policy_ != AllocPolicy::ThreadCache) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        if (policy_ == AllocPolicy::FirstFit) {
+            FirstFitRelease((uint64_t)(uintptr_t)addr);
+            return;
+        }
+        MRChunk* chunk = FindChunk(addr);
+        size_t unit = UnitOf(chunk, addr);
+        release_count_++;
+        used_bytes_ -= kMinBlockSize << chunk->unit_order[unit];
+        requested_bytes_ -= chunk->unit_requested[unit];
+        BuddyFree(addr);
+        return;
+    }
+    MRChunk* chunk = FindChunk(addr);
+    size_t unit = UnitOf(chunk, addr);
+    int order = chunk->unit_order[unit];
+    returned_count_.fetch_add(1, std::memory_order_relaxed);
+    returned_bytes_.fetch_add(kMinBlockSize << order, std::memory_order_relaxed);
+    returned_requested_.fetch_add(chunk->unit_requested[unit], std::memory_order_relaxed);
+    if (order > kMaxCachedOrder) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        BuddyFree(addr);
+        return;
+    }
+    // 无锁地压入归还栈，由分配线程批量取回
+    parked_bytes_.fetch_add(kMinBlockSize << order, std::memory_order_relaxed);
+    FreeNode* node = reinterpret_cast<FreeNode*>(addr);
+    FreeNode* head = returned_[order].load(std::memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!returned_[order].compare_exchange_weak(head, node, std::memory_order_release,
+                                                     std::memory_order_relaxed));
+}
+
+void MRManager::ReleaseBuffers(char* const* addrs, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    if (policy_ != AllocPolicy::ThreadCache) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        for (size_t i = 0; i < n; i++) {
+            if (policy_ == AllocPolicy::FirstFit) {
+                FirstFitRelease((uint64_t)(uintptr_t)addrs[i]);
+                continue;
+            }
+            MRChunk* chunk = FindChunk(addrs[i]);
+            size_t unit = UnitOf(chunk, addrs[i]);
+            release_count_++;
+            used_bytes_ -= kMinBlockSize << chunk->unit_order[unit];
+            requested_bytes_ -= chunk->unit_requested[unit];
+            BuddyFree(addrs[i]);
+        }
+        return;
+    }
+    // 先在本地按级别串成链表，再整体压入归还栈
+    FreeNode* first[kMaxCachedOrder + 1] = {};
+    FreeNode* last[kMaxCachedOrder + 1] = {};
+    uint64_t bytes = 0;
+    uint64_t requested = 0;
+    uint64_t parked = 0;
+    size_t large = 0;
+    for (size_t i = 0; i < n; i++) {
+        MRChunk* chunk = FindChunk(addrs[i]);
+        size_t unit = UnitOf(chunk, addrs[i]);
+        int order = chunk->unit_order[unit];
+        bytes += kMinBlockSize << order;
+        requested += chunk->unit_requested[unit];
+        if (order > kMaxCachedOrder) {
+            large++;
+            continue;
+        }
+        parked += kMinBlockSize << order;
+        FreeNode* node = reinterpret_cast<FreeNode*>(addrs[i]);
+        node->next = first[order];
+        first[order] = node;
+        if (last[order] == nullptr) last[order] = node;
+    }
+    returned_count_.fetch_add(n, std::memory_order_relaxed);
+    returned_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    returned_requested_.fetch_add(requested, std::memory_order_relaxed);
+    parked_bytes_.fetch_add(parked, std::memory_order_relaxed);
+    if (large > 0) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        for (size_t i = 0; i < n; i++) {
+            MRChunk* chunk = FindChunk(addrs[i]);
+            if (chunk->unit_order[UnitOf(chunk, addrs[i])] > kMaxCachedOrder) {
+                BuddyFree(addrs[i]);
+            }
+        }
+    }
+    for (int order = 0; order <= kMaxCachedOrder; order++) {
+        if (first[order] == nullptr) continue;
+        FreeNode* head = returned_[order].load(std::memory_order_relaxed);
+        do {
+            last[order]->next = head;
+        } while (!returned_[order].compare_exchange_weak(head, first[order], std::memory_order_release,
+                                                         std::memory_order_relaxed));
+    }
+}
+
+MRManager::ThreadCacheBin* MRManager::AcquireCache() {
+    if (!caches_) return nullptr;
+    ThreadCacheBin* cache = &caches_[ThreadIndex() % kThreadCaches];
+    if (cache->busy.exchange(true, std::memory_order_acquire)) {
+        return nullptr;
+    }
+    return cache;
+}
+
+void MRManager::RefillCache(ThreadCacheBin* cache, int order) {
+    // 优先取回完成线程归还的块，无需加锁
+    FreeNode* node = returned_[order].exchange(nullptr, std::memory_order_acquire);
+    while (node != nullptr) {
+        FreeNode* next = node->next;
+        parked_bytes_.fetch_sub(kMinBlockSize << order, std::memory_order_relaxed);
+        node->next = cache->heads[order];
+        cache->heads[order] = node;
+        cache->counts[order]++;
+        node = next;
+    }
+    if (cache->heads[order] != nullptr && cache->counts[order] <= kCacheLimit) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (chunk_count_.load() == 0) return;
+    // 超出缓存上限的块归还共享池，以便与伙伴块合并
+    while (cache->counts[order] > kCacheLimit) {
+        FreeNode* extra = cache->heads[order];
+        cache->heads[order] = extra->next;
+        cache->counts[order]--;
+        BuddyFree(reinterpret_cast<char*>(extra));
+    }
+    if (cache->heads[order] != nullptr) return;
+    for (uint32_t i = 0; i < kRefillBatch; i++) {
+        // 仅在第一个块分配失败时增长，批量补充不额外注册chunk
+        char* addr = i == 0 ? PoolAllocate(order) : BuddyAllocate(order);
+        if (addr == nullptr) break;
+        FreeNode* block = reinterpret_cast<FreeNode*>(addr);
+        block->next = cache->heads[order];
+        cache->heads[order] = block;
+        cache->counts[order]++;
+    }
+}
+
+MRManager::UsedSlot* MRManager::FindUsedSlot(uint64_t wr_id) {
+    if (used_slots_.empty()) return nullptr;
+    size_t idx = HashWrId(wr_id) & used_slot_mask_;
+    while (used_slots_[idx].valid) {
+        if (used_slots_[idx].wr_id == wr_id) return &used_slots_[idx];
+        idx = (idx + 1) & used_slot_mask_;
+    }
+    return nullptr;
+}
+
+void MRManager::EraseUsedSlot(UsedSlot* slot) {
+    // 线性探测的后移删除，保证后续元素仍能被找到
+    size_t hole = slot - used_slots_.data();
+    size_t idx = (hole + 1) & used_slot_mask_;
+    while (used_slots_[idx].valid) {
+        size_t home = HashWrId(used_slots_[idx].wr_id) & used_slot_mask_;
+        if (((idx - home) & used_slot_mask_) >= ((idx - hole) & used_slot_mask_)) {
+            used_slots_[hole] = used_slots_[idx];
+            hole = idx;
+        }
+        idx = (idx + 1) & used_slot_mask_;
+    }
+    used_slots_[hole].valid = false;
+}
+
+
+MRStats MRManager::Stats() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    MRStats stats;
+    size_t count = chunk_count_.load();
+    for (size_t i = 0; i < count; i++) {
+        stats.capacity += policy_ != AllocPolicy::FirstFit ? chunks_[i].units * kMinBlockSize : chunks_[i].sz;
+        stats.chunks++;
+        if (chunks_[i].hugepage) stats.hugepage_chunks++;
+    }
+    stats.used_bytes = used_bytes_;
+    stats.requested_bytes = requested_bytes_;
+    stats.alloc_count = alloc_count_;
+    stats.alloc_fail_count = alloc_fail_count_;
+    stats.release_count = release_count_;
+    if (caches_) {
+        for (int i = 0; i < kThreadCaches; i++) {
+            stats.alloc_count += caches_[i].alloc_count.load(std::memory_order_relaxed);
+            stats.used_bytes += caches_[i].alloc_bytes.load(std::memory_order_relaxed);
+            stats.requested_bytes += caches_[i].requested_bytes.load(std::memory_order_relaxed);
+        }
+        stats.release_count += returned_count_.load(std::memory_order_relaxed);
+        stats.used_bytes -= returned_bytes_.load(std::memory_order_relaxed);
+        stats.requested_bytes -= returned_requested_.load(std::memory_order_relaxed);
+        stats.cached_bytes = pool_out_bytes_ - stats.used_bytes;
+    }
+    if (policy_ != AllocPolicy::FirstFit) {
+        for (int order = 0; order < kMaxOrders; order++) {
+            size_t block_sz = kMinBlockSize << order;
+            stats.free_blocks += free_counts_[order];
+            stats.free_bytes += free_counts_[order] * block_sz;
+            if (free_counts_[order] > 0) stats.largest_free_block = block_sz;
+        }
+    } else {
+        for (MemBlock* block = free_list_head_.next; block != nullptr; block = block->next) {
+            stats.free_blocks++;
+            stats.free_bytes += block->sz;
+            stats.largest_free_block = std::max(stats.largest_free_block, block->sz);
+        }
+    }
+    return stats;
+}
+
+void MRManager::PrintBlock() {
+    std::unique_lock<std::mutex> lock(mtx_);
+    if (policy_ != AllocPolicy::FirstFit) {
+        Log(logger_.get(), "=============Free classes:========");
+        for (int order = 0; order < kMaxOrders; order++) {
+            if (free_counts_[order] == 0) continue;
+            Log(logger_.get(), "Class %lu : %lu free", kMinBlockSize << order, free_counts_[order]);
+        }
+        Log(logger_.get(), "==================================");
+        return;
+    }
+    Log(logger_.get(), "=============Free list:===========");
+    for (MemBlock* block = free_list_head_.next; block != nullptr; block = block->next) {
+        Log(logger_.get(), "MemBlock %lu %d", block->addr, block->sz);
+    }
+    Log(logger_.get(), "=============Used list:===========");
+    for (MemBlock* block = used_list_head_.next; block != nullptr; block = block->next) {
+        Log(logger_.get(), "MemBlock %lu %d", block->addr, block->sz);
+    }
+    Log(logger_.get(), "==================================");
+}
+
 std::pair<MemBlock*,MemBlock*> MRManager::MergeBlock(MemBlock* new_block, MemBlock* prev_block, MemBlock* next_block) {
     // Merger front Blocks
     MemBlock* delete_block = nullptr;
@@ -193,4 +836,54 @@ void MRManager::RemoveBlock(MemBlock* block) {
     if (block->next) block->next->prev = block->prev;
 }
 
-}
\ No newline at end of file
+SendWRPool::SendWRPool(uint32_t depth)
+        : depth_(depth), descs_(new SendDesc[depth]), free_(depth) {
+    for (uint32_t i = 0; i < depth; i++) {
+        SendDesc* desc = &descs_[i];
+        memset(&desc->wr, 0, sizeof(desc->wr));
+        memset(&desc->sge, 0, sizeof(desc->sge));
+        desc->wr.wr_id = MakeWrId(WRKind::Send, i);
+        desc->wr.opcode = IBV_WR_SEND;
+        desc->wr.sg_list = &desc->sge;
+        desc->wr.num_sge = 1;
+        desc->wr.send_flags = IBV_SEND_SIGNALED;
+        free_.TryPush(i);
+    }
+}
+
+SendDesc* SendWRPool::Acquire() {
+    uint32_t index;
+    if (!free_.TryPop(index)) {
+        return nullptr;
+    }
+    return &descs_[index];
+}
+
+void SendWRPool::Release(SendDesc* desc) {
+    desc->addr = nullptr;
+    free_.TryPush(WrIndexOf(desc->wr.wr_id));
+}
+
+int RecvWRPool::Init(MRManager* mr_manager, uint32_t depth, uint32_t slot_size) {
+    depth_ = depth;
+    slot_size_ = slot_size;
+    descs_.reset(new RecvDesc[depth]);
+    for (uint32_t i = 0; i < depth; i++) {
+        RecvDesc* desc = &descs_[i];
+        desc->addr = mr_manager->AllocateBuffer(slot_size);
+        if (desc->addr == nullptr) {
+            return -1;
+        }
+        desc->sz = slot_size;
+        memset(&desc->wr, 0, sizeof(desc->wr));
+        desc->wr.wr_id = MakeWrId(WRKind::Recv, i);
+        desc->wr.sg_list = &desc->sge;
+        desc->wr.num_sge = 1;
+        desc->sge.addr = (uintptr_t)desc->addr;
+        desc->sge.length = slot_size;
+        desc->sge.lkey = mr_manager->LKey(desc->addr);
+    }
+    return 0;
+}
+
+}
@@ -6,8 +6,11 @@
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <vector>
+#include <string>
 
 #include "logger.h"
+#include "bounded_queue.h"
 namespace RDMA_ECHO {
 
 struct SendWRWrapper {
@@ -33,6 +36,42 @@ struct RecvWRWrapper {
     uint32_t sz;
 };
 
+// wr_id的高8位标识请求类型，低32位为描述符在池中的序号
+enum class WRKind : uint8_t {
+    Send = 1,
+    Recv = 2,
+    Drain = 3,  // 析构时提交的标记WR，不属于任何描述符池
+};
+
+inline uint64_t MakeWrId(WRKind kind, uint32_t index) {
+    return ((uint64_t)kind << 56) | index;
+}
+
+inline WRKind WrKindOf(uint64_t wr_id) {
+    return (WRKind)(wr_id >> 56);
+}
+
+inline uint32_t WrIndexOf(uint64_t wr_id) {
+    return (uint32_t)wr_id;
+}
+
+// 预先构造的Send描述符，opcode等字段在池创建时填好，发送时只需填写缓冲区
+struct SendDesc {
+    ibv_send_wr wr;
+    ibv_sge sge;
+    char* addr{nullptr};  // 当前关联的发送缓冲区
+    uint32_t msg_id{0};   // 用于RDMA READ时关联的消息序号
+    bool one_sided{false}; // 由应用通过Write/Read提交的单边操作
+};
+
+// 预先构造的Recv描述符，固定绑定一个接收缓冲区槽
+struct RecvDesc {
+    ibv_recv_wr wr;
+    ibv_sge sge;
+    char* addr{nullptr};
+    uint32_t sz{0};
+};
+
 struct MemBlock {
     MemBlock()
             : addr(nullptr), sz(0), prev(nullptr), next(nullptr) {}
@@ -44,33 +83,71 @@ struct MemBlock {
     MemBlock* next;
 };
 
+// 缓冲区分配策略
+enum class AllocPolicy {
+    FirstFit,   // 按地址有序的空闲链表首次适配，释放时合并相邻块
+    SizeClass,  // 按2的幂次分级的伙伴分配，分配与释放只涉及常数个级别，且不进行逐块的堆分配
+    ThreadCache,// 在SizeClass之上为每个线程缓存已切分的块，批量从共享池补充，释放经无锁栈归还
+};
+
+// 分配器统计信息，用于比较不同分配策略的碎片与占用情况
+struct MRStats {
+    size_t capacity{0};            // 注册区域的总字节数
+    size_t used_bytes{0};          // 已分配出的字节数(含分级带来的内部碎片)
+    size_t requested_bytes{0};     // 调用者实际请求的字节数
+    size_t free_bytes{0};          // 空闲字节数
+    size_t free_blocks{0};         // 空闲块数量
+    size_t largest_free_block{0};  // 最大空闲块的字节数
+    size_t cached_bytes{0};        // 已从共享池取出、暂存于线程缓存及归还栈中的字节数
+    size_t chunks{0};              // 已注册的chunk数量
+    size_t hugepage_chunks{0};     // 其中由大页支持的chunk数量
+    uint64_t alloc_count{0};       // 成功分配次数
+    uint64_t alloc_fail_count{0};  // 分配失败次数
+    uint64_t release_count{0};     // 释放次数
+
+    // 内部碎片率：已分配但未被请求使用的字节占比
+    double InternalFragmentation() const {
+        return used_bytes == 0 ? 0.0 : 1.0 - (double)requested_bytes / used_bytes;
+    }
+    // 外部碎片率：空闲字节中不属于最大空闲块的占比
+    double ExternalFragmentation() const {
+        return free_bytes == 0 ? 0.0 : 1.0 - (double)largest_free_block / free_bytes;
+    }
+    // 占用率
+    double Occupancy() const {
+        return capacity == 0 ? 0.0 : (double)used_bytes / capacity;
+    }
+};
+
 // 用于管理Memory Region，创建WQE
 class MRManager {
   public:
-    MRManager(std::shared_ptr<FileLogger> logger) : logger_(logger) {}
+    MRManager(std::shared_ptr<FileLogger> logger, AllocPolicy policy = AllocPolicy::FirstFit)
+        : logger_(logger), policy_(policy) {}
     MRManager(const MRManager&) = delete;
     MRManager& operator=(const MRManager&) = delete;
     ~MRManager();
 
-    void PrintBlock() {
-        Log(logger_.get(), "=============Free list:===========");
-        for (MemBlock* block = free_list_head_.next; block != nullptr; block = block->next) {
-            Log(logger_.get(), "MemBlock %lu %d", block->addr, block->sz);
-        }
-        Log(logger_.get(), "=============Used list:===========");
-        for (MemBlock* block = used_list_head_.next; block != nullptr; block = block->next) {
-            Log(logger_.get(), "MemBlock %lu %d", block->addr, block->sz);
-        }
-        Log(logger_.get(), "==================================");
-    }
-    // 注册Memory Region
+    void PrintBlock();
+    // 注册Memory Region，MRManager接管buffer的所有权
     int RegisterMR(ibv_pd* pd, char* buffer, size_t buffer_sz);
+    // 注册可增长的内存区域：以chunk_sz为单位通过mmap申请并注册，use_hugepage为true时
+    // 优先使用2MiB大页，申请失败时退回普通页；SizeClass/ThreadCache模式下空间耗尽时
+    // 自动注册新的chunk，最多max_chunks个，各chunk拥有独立的lkey
+    int RegisterArena(ibv_pd* pd, size_t chunk_sz, size_t max_chunks, bool use_hugepage);
     // 解除Memory Region的注册
     int DeregisterMR();
 
+    inline AllocPolicy Policy() const { return policy_; }
+    // 返回addr所在chunk的lkey
+    uint32_t LKey(const char* addr) const;
+    // 返回addr所在chunk的rkey，供对端直接读写
+    uint32_t RKey(const char* addr) const;
     inline const MemBlock* FreeList() {return &free_list_head_; }
     inline const MemBlock* UsedList() {return &used_list_head_; }
 
+    // 以下按wr_id分配缓冲区并在堆上新建WQE的接口仅供mr_manager_test检验分配策略，
+    // 数据路径使用SendWRPool/RecvWRPool中预先构造的描述符
     // 新建Send WQE
     std::unique_ptr<SendWRWrapper> AllocateSendWR(uint64_t wr_id, const std::string& msg);
     // 新建Recv WQE
@@ -78,7 +155,130 @@ class MRManager {
     // 任何新建的WQE必须通过ReleaseMR释放缓冲区资源
     void ReleaseMR(uint64_t wr_id);
 
+    // 按地址分配缓冲区，ThreadCache模式下优先从当前线程的缓存中无锁地获取
+    char* AllocateBuffer(uint32_t sz);
+    // 释放AllocateBuffer分配的缓冲区，ThreadCache模式下无锁地压入归还栈，可在任意线程调用
+    void ReleaseBuffer(char* addr);
+    // 批量释放n个缓冲区，至多获取一次锁，ThreadCache模式下每个级别只需一次CAS
+    void ReleaseBuffers(char* const* addrs, size_t n);
+    // 获取分配器统计信息的快照
+    MRStats Stats();
+
   private:
+    // SizeClass模式下的最小块大小，空闲块内嵌FreeNode链表指针
+    static constexpr size_t kMinBlockSize = 64;
+    static constexpr int kMaxOrders = 32;
+    static constexpr uint8_t kFreeFlag = 0x80;
+    static constexpr uint8_t kNotHead = 0x7F;
+    static constexpr size_t kMaxChunks = 64;
+    static constexpr size_t kHugePageSize = 2 << 20;
+
+    // FirstFit模式下按地址分配时used_blocks_以地址为键
+    static constexpr uint64_t kAddrKey = ~0ULL;
+    // ThreadCache模式下可被线程缓存的最大级别(64KiB)，更大的块直接访问共享池
+    static constexpr int kMaxCachedOrder = 10;
+    static constexpr int kThreadCaches = 16;
+    // 每次从共享池补充的块数
+    static constexpr uint32_t kRefillBatch = 8;
+    // 单个级别在线程缓存中的块数上限，超出部分归还共享池
+    static constexpr uint32_t kCacheLimit = 4 * kRefillBatch;
+
+    // 一段独立注册的内存，SizeClass模式下伙伴块不会跨越chunk
+    struct MRChunk {
+        char* addr{nullptr};
+        size_t sz{0};
+        ibv_mr* mr{nullptr};
+        bool mapped{false};    // 由mmap申请，否则为调用者传入的new[]缓冲区
+        bool hugepage{false};
+        size_t units{0};       // 以kMinBlockSize为单位的长度
+        int max_order{0};
+        std::unique_ptr<uint8_t[]> unit_order;      // 每个单位：块首记录级别(空闲时带kFreeFlag)，非块首为kNotHead
+        std::unique_ptr<uint32_t[]> unit_requested; // 每个按地址分配的块的请求字节数
+    };
+
+    // SizeClass模式下嵌入在空闲块头部的双向链表节点，线程缓存与归还栈中仅使用next
+    struct FreeNode {
+        FreeNode* prev;
+        FreeNode* next;
+    };
+
+    // 线程缓存，busy标志保证同一时刻只有一个线程使用
+    struct ThreadCacheBin {
+        std::atomic<bool> busy{false};
+        FreeNode* heads[kMaxCachedOrder + 1] = {};
+        uint32_t counts[kMaxCachedOrder + 1] = {};
+        std::atomic<uint64_t> alloc_count{0};
+        std::atomic<uint64_t> alloc_bytes{0};
+        std::atomic<uint64_t> requested_bytes{0};
+        char padding[64];  // 避免相邻缓存的伪共享
+    };
+
+    // SizeClass模式下<wr_id : 已分配块>的开放寻址表，仅在注册新chunk时扩容
+    struct UsedSlot {
+        uint64_t wr_id;
+        char* addr;
+        uint32_t requested;
+        bool valid;
+    };
+
+    // 以下函数均需在持有mtx_时调用
+    char* AllocateBlock(uint64_t wr_id, uint32_t sz);
+
+    char* FirstFitAllocate(uint64_t wr_id, uint32_t sz);
+
+    void FirstFitRelease(uint64_t wr_id);
+
+    char* SizeClassAllocate(uint64_t wr_id, uint32_t sz);
+
+    void SizeClassRelease(uint64_t wr_id);
+
+    // 从共享池分配，必要时取回归还栈中的块或注册新的chunk
+    char* PoolAllocate(int order);
+
+    char* BuddyAllocate(int order);
+
+    void BuddyFree(char* addr);
+
+    // 将归还栈中的块全部放回共享池
+    void DrainReturned();
+
+    // 申请并注册一个sz字节的新chunk，失败返回-1
+    int Grow(size_t sz);
+
+    int AddChunk(char* addr, size_t sz, bool mapped, bool hugepage);
+
+    void ReleaseChunks();
+
+    void ResizeUsedSlots(size_t units);
+
+    // 以下函数无需持有mtx_
+    ThreadCacheBin* AcquireCache();
+
+    void RefillCache(ThreadCacheBin* cache, int order);
+
+    // chunk只增不减，可无锁地查找
+    MRChunk* FindChunk(const char* addr) const;
+
+    inline int OrderOf(uint32_t sz) const {
+        int order = 0;
+        while ((kMinBlockSize << order) < sz) order++;
+        return order;
+    }
+
+    inline size_t UnitOf(const MRChunk* chunk, const char* addr) const {
+        return (addr - chunk->addr) / kMinBlockSize;
+    }
+
+    void PushFree(MRChunk* chunk, size_t unit, int order);
+
+    void RemoveFree(FreeNode* node, int order);
+
+    UsedSlot* FindUsedSlot(uint64_t wr_id);
+
+    void EraseUsedSlot(UsedSlot* slot);
+
+    void ClearBlocks();
+
     std::pair<MemBlock*,MemBlock*> MergeBlock(MemBlock* new_block, MemBlock* prev_block, MemBlock* next_block);
 
     void InsertBlock(MemBlock* new_block, MemBlock* list, bool merge);
@@ -90,15 +290,88 @@ class MRManager {
     std::unique_ptr<RecvWRWrapper> ConstructRecvMR(uint64_t wr_id, char *addr, uint32_t sz);
 
     std::shared_ptr<FileLogger> logger_;
-    char* buffer_{nullptr};
-    size_t buffer_sz_{0};
-    ibv_mr* mr_{nullptr};
+    AllocPolicy policy_;
+
+    // 已注册的chunk，数组在注册时一次性分配，chunk_count_以release语义发布新chunk
+    std::unique_ptr<MRChunk[]> chunks_;
+    std::atomic<size_t> chunk_count_{0};
+    ibv_pd* pd_{nullptr};
+    size_t chunk_sz_{0};
+    size_t max_chunks_{1};
+    bool use_hugepage_{false};
 
+    // FirstFit，仅使用第一个chunk
     std::unordered_map<uint64_t, MemBlock*> used_blocks_;
     MemBlock free_list_head_;
     MemBlock used_list_head_;
+
+    // SizeClass
+    size_t units_{0};                          // 所有chunk的单位总数
+    FreeNode* free_heads_[kMaxOrders] = {};    // 每个级别的空闲链表
+    size_t free_counts_[kMaxOrders] = {};
+    std::vector<UsedSlot> used_slots_;
+    size_t used_slot_mask_{0};
+    size_t used_slot_count_{0};
+
+    // ThreadCache
+    std::unique_ptr<ThreadCacheBin[]> caches_;
+    std::atomic<FreeNode*> returned_[kMaxCachedOrder + 1] = {};  // 各级别的无锁归还栈
+    size_t pool_out_bytes_{0};               // 已从伙伴空闲链表取出的字节数
+    std::atomic<uint64_t> returned_count_{0};
+    std::atomic<uint64_t> returned_bytes_{0};
+    std::atomic<uint64_t> returned_requested_{0};
+    std::atomic<uint64_t> parked_bytes_{0};  // 归还栈中的字节数
+
+    size_t used_bytes_{0};
+    size_t requested_bytes_{0};
+    uint64_t alloc_count_{0};
+    uint64_t alloc_fail_count_{0};
+    uint64_t release_count_{0};
     std::mutex mtx_;
 };
 
+// 定长的Send描述符池，大小与QP的发送队列深度一致
+class SendWRPool {
+  public:
+    explicit SendWRPool(uint32_t depth);
+    SendWRPool(const SendWRPool&) = delete;
+    SendWRPool& operator=(const SendWRPool&) = delete;
+
+    // 获取一个空闲描述符，池为空时返回nullptr
+    SendDesc* Acquire();
+    // 归还描述符，通常在HandleWorkComplete中调用
+    void Release(SendDesc* desc);
+    // 根据wr_id找到对应的描述符
+    inline SendDesc* Get(uint64_t wr_id) { return &descs_[WrIndexOf(wr_id)]; }
+    inline uint32_t Depth() const { return depth_; }
+    // 近似的空闲描述符数量
+    inline size_t Available() const { return free_.Size(); }
+
+  private:
+    uint32_t depth_;
+    std::unique_ptr<SendDesc[]> descs_;
+    BoundedQueue<uint32_t> free_;
+};
+
+// 定长的Recv描述符池，每个描述符在初始化时绑定一个接收缓冲区槽并始终复用
+class RecvWRPool {
+  public:
+    RecvWRPool() = default;
+    RecvWRPool(const RecvWRPool&) = delete;
+    RecvWRPool& operator=(const RecvWRPool&) = delete;
+
+    // 从mr_manager中为每个描述符切分slot_size字节的缓冲区，失败返回-1
+    int Init(MRManager* mr_manager, uint32_t depth, uint32_t slot_size);
+    inline RecvDesc* Get(uint64_t wr_id) { return &descs_[WrIndexOf(wr_id)]; }
+    inline RecvDesc* At(uint32_t index) { return &descs_[index]; }
+    inline uint32_t Depth() const { return depth_; }
+    inline uint32_t SlotSize() const { return slot_size_; }
+
+  private:
+    uint32_t depth_{0};
+    uint32_t slot_size_{0};
+    std::unique_ptr<RecvDesc[]> descs_;
+};
+
 }
 #endif
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "mr_manager.h"
 #include <gtest/gtest.h>
+#include <thread>
+#include <vector>
 // Demonstrate some basic assertions.
 TEST(MRManagerTest, Allocate) {
     std::FILE* f = std::fopen("test.log", "w");
@@ -59,4 +61,322 @@ TEST(MRManagerTest, AllocateAndRelease) {
     ibv_free_device_list (dev_list);
     ibv_close_device (ctx);
     ibv_dealloc_pd(pd);
-}
\ No newline at end of file
+}
+
+TEST(MRManagerTest, SizeClassAllocateAndRelease) {
+    std::FILE* f = std::fopen("test.log", "w");
+    auto logger_ = std::make_shared<RDMA_ECHO::FileLogger>(f, true);
+    RDMA_ECHO::MRManager mr_manager(logger_, RDMA_ECHO::AllocPolicy::SizeClass);
+    char* buffer = new char[1024];
+
+    auto dev_list = ibv_get_device_list(NULL);
+    auto ctx = ibv_open_device(*dev_list);
+    auto pd = ibv_alloc_pd(ctx);
+    EXPECT_NE(pd, nullptr);
+    EXPECT_EQ(mr_manager.RegisterMR(pd, buffer, 1024), 0);
+    for (int i = 0; i < 10; i++) {
+        auto wr = mr_manager.AllocateSendWR(i, std::string(10, 'a'));
+        EXPECT_NE(wr, nullptr);
+        char* addr = (char*)wr->sge->addr;
+        EXPECT_GE(addr, buffer);
+        EXPECT_LT(addr, buffer + 1024);
+        EXPECT_EQ((addr - buffer) % 64, 0);
+    }
+    RDMA_ECHO::MRStats stats = mr_manager.Stats();
+    EXPECT_EQ(stats.capacity, 1024);
+    EXPECT_EQ(stats.used_bytes, 10 * 64);
+    EXPECT_EQ(stats.requested_bytes, 10 * 11);
+    EXPECT_EQ(stats.free_bytes, 1024 - 10 * 64);
+    // 1024字节的区域只能容纳16个64字节的块
+    for (int i = 10; i < 16; i++) {
+        EXPECT_NE(mr_manager.AllocateSendWR(i, std::string(10, 'a')), nullptr);
+    }
+    EXPECT_EQ(mr_manager.AllocateSendWR(16, std::string(10, 'a')), nullptr);
+    EXPECT_EQ(mr_manager.Stats().alloc_fail_count, 1);
+
+    for (int i = 0; i < 16; i++) {
+        mr_manager.ReleaseMR(i);
+    }
+    mr_manager.PrintBlock();
+    stats = mr_manager.Stats();
+    EXPECT_EQ(stats.used_bytes, 0);
+    EXPECT_EQ(stats.free_blocks, 1);
+    EXPECT_EQ(stats.largest_free_block, 1024);
+    EXPECT_EQ(stats.release_count, 16);
+    ibv_free_device_list (dev_list);
+    ibv_close_device (ctx);
+    ibv_dealloc_pd(pd);
+}
+
+TEST(MRManagerTest, SizeClassFragmentation) {
+    std::FILE* f = std::fopen("test.log", "w");
+    auto logger_ = std::make_shared<RDMA_ECHO::FileLogger>(f, true);
+    RDMA_ECHO::MRManager first_fit(logger_, RDMA_ECHO::AllocPolicy::FirstFit);
+    RDMA_ECHO::MRManager size_class(logger_, RDMA_ECHO::AllocPolicy::SizeClass);
+
+    auto dev_list = ibv_get_device_list(NULL);
+    auto ctx = ibv_open_device(*dev_list);
+    auto pd = ibv_alloc_pd(ctx);
+    EXPECT_NE(pd, nullptr);
+    EXPECT_EQ(first_fit.RegisterMR(pd, new char[4096], 4096), 0);
+    EXPECT_EQ(size_class.RegisterMR(pd, new char[4096], 4096), 0);
+    // 交替释放不同大小的块，制造空洞
+    for (int i = 0; i < 16; i++) {
+        std::string msg(i % 2 ? 100 : 30, 'a');
+        EXPECT_NE(first_fit.AllocateSendWR(i, msg), nullptr);
+        EXPECT_NE(size_class.AllocateSendWR(i, msg), nullptr);
+    }
+    for (int i = 0; i < 16; i += 2) {
+        first_fit.ReleaseMR(i);
+        size_class.ReleaseMR(i);
+    }
+    RDMA_ECHO::MRStats ff = first_fit.Stats();
+    RDMA_ECHO::MRStats sc = size_class.Stats();
+    EXPECT_EQ(ff.requested_bytes, sc.requested_bytes);
+    EXPECT_EQ(ff.InternalFragmentation(), 0.0);
+    EXPECT_GT(sc.InternalFragmentation(), 0.0);
+    EXPECT_GT(ff.free_blocks, 1);
+    EXPECT_GT(ff.ExternalFragmentation(), 0.0);
+    // 释放全部块后两种策略都应合并回完整区域
+    for (int i = 1; i < 16; i += 2) {
+        first_fit.ReleaseMR(i);
+        size_class.ReleaseMR(i);
+    }
+    EXPECT_EQ(size_class.Stats().free_blocks, 1);
+    EXPECT_EQ(size_class.Stats().largest_free_block, 4096);
+    ibv_free_device_list (dev_list);
+    ibv_close_device (ctx);
+    ibv_dealloc_pd(pd);
+}
+
+TEST(MRManagerTest, ThreadCacheConcurrentAllocateAndRelease) {
+    std::FILE* f = std::fopen("test.log", "w");
+    auto logger_ = std::make_shared<RDMA_ECHO::FileLogger>(f, false);
+    RDMA_ECHO::MRManager mr_manager(logger_, RDMA_ECHO::AllocPolicy::ThreadCache);
+    char* buffer = new char[1 << 20];
+
+    auto dev_list = ibv_get_device_list(NULL);
+    auto ctx = ibv_open_device(*dev_list);
+    auto pd = ibv_alloc_pd(ctx);
+    EXPECT_NE(pd, nullptr);
+    EXPECT_EQ(mr_manager.RegisterMR(pd, buffer, 1 << 20), 0);
+
+    // 多个生产者线程分配，由单一的“完成线程”释放
+    constexpr int kThreads = 4;
+    constexpr int kRounds = 10000;
+    std::mutex mtx;
+    std::vector<char*> pending;
+    std::atomic<int> producers{kThreads};
+    std::thread completion([&]() {
+        while (true) {
+            bool done = producers.load() == 0;
+            std::vector<char*> batch;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                batch.swap(pending);
+            }
+            for (char* addr : batch) {
+                mr_manager.ReleaseBuffer(addr);
+            }
+            if (batch.empty() && done) break;
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < kRounds; i++) {
+                uint32_t sz = 16 + (i * 37 + t) % 1000;
+                char* addr = mr_manager.AllocateBuffer(sz);
+                if (addr == nullptr) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                EXPECT_GE(addr, buffer);
+                EXPECT_LE(addr + sz, buffer + (1 << 20));
+                memset(addr, t, sz);
+                std::unique_lock<std::mutex> lock(mtx);
+                pending.push_back(addr);
+            }
+            producers.fetch_sub(1);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    completion.join();
+
+    RDMA_ECHO::MRStats stats = mr_manager.Stats();
+    EXPECT_EQ(stats.used_bytes, 0);
+    EXPECT_EQ(stats.requested_bytes, 0);
+    EXPECT_EQ(stats.alloc_count, stats.release_count);
+    EXPECT_EQ(stats.free_bytes + stats.cached_bytes, stats.capacity);
+    ibv_free_device_list (dev_list);
+    ibv_close_device (ctx);
+    ibv_dealloc_pd(pd);
+}
+
+TEST(MRManagerTest, WRPool) {
+    std::FILE* f = std::fopen("test.log", "w");
+    auto logger_ = std::make_shared<RDMA_ECHO::FileLogger>(f, true);
+    RDMA_ECHO::MRManager mr_manager(logger_, RDMA_ECHO::AllocPolicy::SizeClass);
+    char* buffer = new char[4096];
+
+    auto dev_list = ibv_get_device_list(NULL);
+    auto ctx = ibv_open_device(*dev_list);
+    auto pd = ibv_alloc_pd(ctx);
+    EXPECT_NE(pd, nullptr);
+    EXPECT_EQ(mr_manager.RegisterMR(pd, buffer, 4096), 0);
+
+    RDMA_ECHO::SendWRPool send_pool(30);
+    std::vector<RDMA_ECHO::SendDesc*> descs;
+    for (int i = 0; i < 30; i++) {
+        RDMA_ECHO::SendDesc* desc = send_pool.Acquire();
+        EXPECT_NE(desc, nullptr);
+        EXPECT_EQ(desc->wr.opcode, IBV_WR_SEND);
+        EXPECT_EQ(desc->wr.sg_list, &desc->sge);
+        EXPECT_EQ(RDMA_ECHO::WrKindOf(desc->wr.wr_id), RDMA_ECHO::WRKind::Send);
+        EXPECT_EQ(send_pool.Get(desc->wr.wr_id), desc);
+        descs.push_back(desc);
+    }
+    // 描述符数量与队列深度一致
+    EXPECT_EQ(send_pool.Acquire(), nullptr);
+    send_pool.Release(descs[3]);
+    EXPECT_EQ(send_pool.Acquire(), descs[3]);
+
+    RDMA_ECHO::RecvWRPool recv_pool;
+    EXPECT_EQ(recv_pool.Init(&mr_manager, 30, 50), 0);
+    for (uint32_t i = 0; i < recv_pool.Depth(); i++) {
+        RDMA_ECHO::RecvDesc* desc = recv_pool.At(i);
+        EXPECT_EQ(recv_pool.Get(desc->wr.wr_id), desc);
+        EXPECT_EQ(desc->sge.addr, (uintptr_t)desc->addr);
+        EXPECT_EQ(desc->sge.length, 50);
+        EXPECT_GE(desc->addr, buffer);
+        EXPECT_LE(desc->addr + 50, buffer + 4096);
+    }
+    ibv_free_device_list (dev_list);
+    ibv_close_device (ctx);
+    ibv_dealloc_pd(pd);
+}
+
+TEST(MRManagerTest, ArenaGrow) {
+    std::FILE* f = std::fopen("test.log", "w");
+    auto logger_ = std::make_shared<RDMA_ECHO::FileLogger>(f, true);
+    RDMA_ECHO::MRManager mr_manager(logger_, RDMA_ECHO::AllocPolicy::ThreadCache);
+
+    auto dev_list = ibv_get_device_list(NULL);
+    auto ctx = ibv_open_device(*dev_list);
+    auto pd = ibv_alloc_pd(ctx);
+    EXPECT_NE(pd, nullptr);
+    // 大页不可用时退回普通页
+    EXPECT_EQ(mr_manager.RegisterArena(pd, 4096, 4, true), 0);
+    RDMA_ECHO::MRStats stats = mr_manager.Stats();
+    EXPECT_EQ(stats.chunks, 1);
+    size_t chunk_sz = stats.capacity;
+
+    // 分配超过一个chunk的缓冲区，触发增长
+    std::vector<char*> addrs;
+    for (size_t i = 0; i < chunk_sz / 1024 * 3; i++) {
+        char* addr = mr_manager.AllocateBuffer(1000);
+        EXPECT_NE(addr, nullptr);
+        addrs.push_back(addr);
+    }
+    stats = mr_manager.Stats();
+    EXPECT_EQ(stats.chunks, 3);
+    EXPECT_EQ(stats.capacity, chunk_sz * 3);
+    // 不同chunk拥有不同的lkey
+    EXPECT_NE(mr_manager.LKey(addrs.front()), mr_manager.LKey(addrs.back()));
+
+    // 达到chunk数量上限后分配失败
+    while (mr_manager.AllocateBuffer(1000) != nullptr) {}
+    stats = mr_manager.Stats();
+    EXPECT_EQ(stats.chunks, 4);
+    EXPECT_GT(stats.alloc_fail_count, 0);
+
+    for (char* addr : addrs) {
+        mr_manager.ReleaseBuffer(addr);
+    }
+    EXPECT_EQ(mr_manager.DeregisterMR(), 0);
+    EXPECT_EQ(mr_manager.Stats().chunks, 0);
+    ibv_free_device_list (dev_list);
+    ibv_close_device (ctx);
+    ibv_dealloc_pd(pd);
+}
+
+TEST(MRManagerTest, ArenaOversizedBlock) {
+    std::FILE* f = std::fopen("test.log", "w");
+    auto logger_ = std::make_shared<RDMA_ECHO::FileLogger>(f, true);
+    RDMA_ECHO::MRManager mr_manager(logger_, RDMA_ECHO::AllocPolicy::SizeClass);
+
+    auto dev_list = ibv_get_device_list(NULL);
+    auto ctx = ibv_open_device(*dev_list);
+    auto pd = ibv_alloc_pd(ctx);
+    EXPECT_NE(pd, nullptr);
+    EXPECT_EQ(mr_manager.RegisterArena(pd, 4096, 4, false), 0);
+
+    // 超过chunk大小的块独占一个按块大小注册的chunk
+    char* addr = mr_manager.AllocateBuffer(3 * 4096);
+    EXPECT_NE(addr, nullptr);
+    RDMA_ECHO::MRStats stats = mr_manager.Stats();
+    EXPECT_EQ(stats.chunks, 2);
+    EXPECT_EQ(stats.capacity, 4096 + 4 * 4096);
+    EXPECT_NE(mr_manager.LKey(addr), 0);
+    EXPECT_NE(mr_manager.RKey(addr), 0);
+
+    // 普通大小的块仍从第一个chunk分配
+    char* small = mr_manager.AllocateBuffer(100);
+    EXPECT_NE(small, nullptr);
+    EXPECT_EQ(mr_manager.Stats().chunks, 2);
+
+    mr_manager.ReleaseBuffer(addr);
+    mr_manager.ReleaseBuffer(small);
+    EXPECT_EQ(mr_manager.Stats().used_bytes, 0);
+    EXPECT_EQ(mr_manager.DeregisterMR(), 0);
+    ibv_free_device_list (dev_list);
+    ibv_close_device (ctx);
+    ibv_dealloc_pd(pd);
+}
+
+TEST(MRManagerTest, ReleaseBuffers) {
+    std::FILE* f = std::fopen("test.log", "w");
+    auto logger_ = std::make_shared<RDMA_ECHO::FileLogger>(f, true);
+    RDMA_ECHO::MRManager thread_cache(logger_, RDMA_ECHO::AllocPolicy::ThreadCache);
+    RDMA_ECHO::MRManager size_class(logger_, RDMA_ECHO::AllocPolicy::SizeClass);
+
+    auto dev_list = ibv_get_device_list(NULL);
+    auto ctx = ibv_open_device(*dev_list);
+    auto pd = ibv_alloc_pd(ctx);
+    EXPECT_NE(pd, nullptr);
+    EXPECT_EQ(thread_cache.RegisterMR(pd, new char[1 << 20], 1 << 20), 0);
+    EXPECT_EQ(size_class.RegisterMR(pd, new char[1 << 20], 1 << 20), 0);
+    // 混合不同级别以及超过线程缓存上限的块
+    std::vector<char*> tc_addrs;
+    std::vector<char*> sc_addrs;
+    for (int i = 0; i < 64; i++) {
+        uint32_t sz = i % 16 == 0 ? 128 << 10 : 64 + i * 40;
+        tc_addrs.push_back(thread_cache.AllocateBuffer(sz));
+        sc_addrs.push_back(size_class.AllocateBuffer(sz));
+        EXPECT_NE(tc_addrs.back(), nullptr);
+        EXPECT_NE(sc_addrs.back(), nullptr);
+    }
+    thread_cache.ReleaseBuffers(tc_addrs.data(), tc_addrs.size());
+    size_class.ReleaseBuffers(sc_addrs.data(), sc_addrs.size());
+
+    RDMA_ECHO::MRStats stats = thread_cache.Stats();
+    EXPECT_EQ(stats.used_bytes, 0);
+    EXPECT_EQ(stats.requested_bytes, 0);
+    EXPECT_EQ(stats.alloc_count, stats.release_count);
+    EXPECT_EQ(stats.free_bytes + stats.cached_bytes, stats.capacity);
+    stats = size_class.Stats();
+    EXPECT_EQ(stats.used_bytes, 0);
+    EXPECT_EQ(stats.free_blocks, 1);
+    EXPECT_EQ(stats.release_count, 64);
+    // 归还的块可被再次分配
+    for (int i = 0; i < 64; i++) {
+        char* addr = thread_cache.AllocateBuffer(64 + i * 40);
+        EXPECT_NE(addr, nullptr);
+        thread_cache.ReleaseBuffer(addr);
+    }
+    ibv_free_device_list (dev_list);
+    ibv_close_device (ctx);
+    ibv_dealloc_pd(pd);
+}
@@ -2,6 +2,11 @@
 #define RDMA_CLIENT_H
 
 #include <memory>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include <netdb.h>
 
 #include "logger.h"
@@ -9,14 +14,125 @@
 
 namespace RDMA_ECHO {
 
+// 连接组中未指定key的消息如何选择连接
+enum class GroupPolicy {
+    ThreadAffinity,  // 每个发送线程固定使用一个连接，线程依次分配至各连接
+    RoundRobin,      // 每条消息依次使用下一个连接
+};
+
+// 到同一对端的多个连接，每个连接拥有独立的QP、CQ、发送/接收内存区域与锁，
+// 发送分散至各连接以随发送线程数扩展吞吐；不同连接之间不保证顺序，
+// 需要保序的消息应使用相同的key或由同一线程在ThreadAffinity下发送
+class RDMAProxyGroup {
+  public:
+    RDMAProxyGroup(std::vector<std::unique_ptr<RDMAProxy>> proxies, GroupPolicy policy)
+        : proxies_(std::move(proxies)), policy_(policy), id_(NextGroupId()) {}
+
+    inline size_t Size() const { return proxies_.size(); }
+
+    inline RDMAProxy* At(size_t i) { return proxies_[i].get(); }
+
+    // 按policy选择连接发送msg，提交失败返回-1
+    int SendMessage(const std::string& msg) {
+        return Pick()->SendMessage(msg);
+    }
+
+    // 相同key的消息总经由同一连接发送，因而保持顺序
+    int SendMessage(uint64_t key, const std::string& msg) {
+        return proxies_[std::hash<uint64_t>()(key) % proxies_.size()]->SendMessage(msg);
+    }
+
+    // 从任一连接获取一条消息，各连接间不保证顺序；全部连接关闭且均无消息时返回-1。
+    // 各连接均无消息时轮流在其中一个连接上空转后限时阻塞，该连接的消息可立即唤醒接收方，
+    // 其余连接的消息至多延迟GROUPRECVWAITUS
+    int RecvMessage(std::string& msg) {
+        while (true) {
+            bool active = false;
+            size_t start = next_recv_.fetch_add(1, std::memory_order_relaxed);
+            RDMAProxy* park = nullptr;
+            for (size_t i = 0; i < proxies_.size(); i++) {
+                RDMAProxy* proxy = proxies_[(start + i) % proxies_.size()].get();
+                if (proxy->TryRecv(msg) == 0) {
+                    return 0;
+                }
+                if (proxy->IsActive()) {
+                    active = true;
+                    if (park == nullptr) park = proxy;
+                }
+            }
+            if (!active) {
+                return -1;
+            }
+            if (park->RecvMessageFor(msg, GROUPRECVWAITUS) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    // 对每个连接调用Flush，任一失败时返回-1
+    int Flush() {
+        int ret = 0;
+        for (auto& proxy : proxies_) {
+            if (proxy->Flush()) ret = -1;
+        }
+        return ret;
+    }
+
+    int Disconnect() {
+        int ret = 0;
+        for (auto& proxy : proxies_) {
+            if (proxy->Disconnect()) ret = -1;
+        }
+        return ret;
+    }
+
+    // 所有连接均未关闭
+    bool IsActive() {
+        for (auto& proxy : proxies_) {
+            if (!proxy->IsActive()) return false;
+        }
+        return true;
+    }
+
+  private:
+    RDMAProxy* Pick() {
+        if (policy_ == GroupPolicy::RoundRobin) {
+            return proxies_[next_send_.fetch_add(1, std::memory_order_relaxed) % proxies_.size()].get();
+        }
+        // 线程首次经由本组发送时取得本组内的序号，此后总使用同一连接；各组独立计数，
+        // 使同一批线程在每个组中均匀分布
+        thread_local std::unordered_map<uint64_t, size_t> thread_slots;
+        auto it = thread_slots.find(id_);
+        if (it == thread_slots.end()) {
+            it = thread_slots.emplace(id_, next_thread_.fetch_add(1, std::memory_order_relaxed)).first;
+        }
+        return proxies_[it->second % proxies_.size()].get();
+    }
+
+    // 组的唯一编号，用作线程序号表的key，避免析构后地址被新组复用时沿用旧序号
+    static uint64_t NextGroupId() {
+        static std::atomic<uint64_t> next_id{0};
+        return next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static constexpr uint32_t GROUPRECVWAITUS = 1000;
+
+    std::vector<std::unique_ptr<RDMAProxy>> proxies_;
+    GroupPolicy policy_;
+    uint64_t id_;
+    std::atomic<size_t> next_thread_{0};
+    std::atomic<size_t> next_send_{0};
+    std::atomic<size_t> next_recv_{0};
+};
 
 class RDMAClient {
   
   public:
-    RDMAClient(const std::string& logger_file) {
+    RDMAClient(const std::string& logger_file, const RDMAProxyOptions& options = RDMAProxyOptions())
+            : options_(options) {
         std::FILE* f = std::fopen(logger_file.c_str(), "w");
         TEST(f != nullptr);
-        logger_ = std::make_shared<FileLogger>(f, true);
+        logger_ = std::make_shared<FileLogger>(f, options.log_terminal, options.async_log);
     }
     ~RDMAClient() {
     }
@@ -46,14 +162,16 @@ class RDMAClient {
                 , id.c_str(), port.c_str(), strerror(errno));
             return nullptr;
         }
-        auto proxy = GenerateProxy(conn, logger_);
+        auto proxy = GenerateProxy(conn, logger_, options_);
         if (!proxy) {
             Log(logger_.get(), "GenerateProxy %s:%s Fail(%s)"
                 , id.c_str(), port.c_str(), strerror(errno));
+            rdma_destroy_id(conn);
+            rdma_destroy_event_channel(ec);
             return nullptr;
         }
         // 建立连接
-        if (WaitConnected(conn)) {
+        if (WaitConnected(conn, proxy.get())) {
             Log(logger_.get(), "RDMAClient Connecting: WaitConnected %s:%s Fail(%s)"
                 , id.c_str(), port.c_str(), strerror(errno));
             return nullptr;
@@ -65,6 +183,25 @@ class RDMAClient {
         }
         return proxy;
     }
+    // 建立n个到id:port的连接并组成连接组，任一连接失败时返回nullptr
+    std::unique_ptr<RDMAProxyGroup> ConnectGroup(const std::string& id, const std::string& port, size_t n,
+                                                 GroupPolicy policy = GroupPolicy::ThreadAffinity) {
+        if (n == 0) {
+            Log(logger_.get(), "RDMAClient ConnectGroup: empty group");
+            return nullptr;
+        }
+        std::vector<std::unique_ptr<RDMAProxy>> proxies;
+        for (size_t i = 0; i < n; i++) {
+            auto proxy = Connect(id, port);
+            if (!proxy) {
+                Log(logger_.get(), "RDMAClient ConnectGroup: connection %lu/%lu to %s:%s Fail", i, n, id.c_str(), port.c_str());
+                return nullptr;
+            }
+            proxies.push_back(std::move(proxy));
+        }
+        Log(logger_.get(), "RDMAClient ConnectGroup %s:%s, %lu connections", id.c_str(), port.c_str(), n);
+        return std::unique_ptr<RDMAProxyGroup>(new RDMAProxyGroup(std::move(proxies), policy));
+    }
   private:
     int WaitResolveAddr(rdma_cm_id *conn, const std::string& id, const std::string& port) {
         struct addrinfo *addr;
@@ -105,10 +242,10 @@ class RDMAClient {
         Log(logger_.get(), "RDMAClient Connecting: ResolveRoute Success");
         return 0;
     }
-    int WaitConnected(rdma_cm_id *conn) {
+    int WaitConnected(rdma_cm_id *conn, RDMAProxy* proxy) {
         struct rdma_cm_event *event = nullptr;
         rdma_conn_param conn_parm;
-        memset(&conn_parm, 0, sizeof(conn_parm));
+        proxy->FillConnParam(nullptr, &conn_parm);
         if (rdma_connect(conn, &conn_parm)) {
             Log(logger_.get(), "RDMAClient Connecting: rdma_connect Fail(%s)", strerror(errno));
             return -1;
@@ -118,11 +255,13 @@ class RDMAClient {
             return -1;
         }
         TEST(event->event == RDMA_CM_EVENT_ESTABLISHED);
+        proxy->SetPeerInfo(event->param.conn.private_data, event->param.conn.private_data_len);
         rdma_ack_cm_event(event);
         Log(logger_.get(), "RDMAClient Connect Success");
         return 0;
     }
     std::shared_ptr<FileLogger> logger_;
+    RDMAProxyOptions options_;
 };
 
 
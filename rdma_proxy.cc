@@ -1,28 +1,63 @@
 #include <thread>
 #include <atomic>
+#include <algorithm>
 #include <mutex>
 #include <condition_variable>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "logger.h"
 #include "rdma_proxy.h"
+#include "rdma_reactor.h"
 
 namespace RDMA_ECHO {
 
-std::unique_ptr<RDMAProxy> GenerateProxy(rdma_cm_id *conn, std::shared_ptr<FileLogger> logger) {
-    if((conn->pd = ibv_alloc_pd(conn->verbs)) == nullptr) {
-        Log(logger.get(), "ibv_alloc_pd Fail(%s)", strerror(errno));
+std::unique_ptr<RDMAProxy> GenerateProxy(rdma_cm_id *conn, std::shared_ptr<FileLogger> logger,
+                                         const RDMAProxyOptions& options) {
+    if (options.send_wr_depth == 0 || options.recv_wr_depth < MINRECVDEPTH) {
+        Log(logger.get(), "Invalid send_wr_depth %u or recv_wr_depth %u", options.send_wr_depth, options.recv_wr_depth);
         return nullptr;
     }
-    if((conn->send_cq = ibv_create_cq(conn->verbs, 30, nullptr, nullptr, 0)) == nullptr) {
-        Log(logger.get(), "create send_cq Fail(%s)", strerror(errno));
+    // 接收槽须能容纳rendezvous请求帧
+    if (options.recv_slot_size < sizeof(MsgHeader) + sizeof(RendezvousInfo)) {
+        Log(logger.get(), "recv_slot_size %u too small", options.recv_slot_size);
         return nullptr;
     }
-    if((conn->recv_cq = ibv_create_cq(conn->verbs, 30, nullptr, nullptr, 0)) == nullptr) {
-        Log(logger.get(), "create recv_cq Fail(%s)", strerror(errno));
+    // 先创建上下文，此后任一步骤失败时由其析构释放已创建的资源，包括归还reactor中预留的CQE
+    std::unique_ptr<RDMAProxyContext> proxy_context =
+        std::unique_ptr<RDMAProxyContext>(new RDMAProxyContext(conn, logger, options));
+    if((conn->pd = ibv_alloc_pd(conn->verbs)) == nullptr) {
+        Log(logger.get(), "ibv_alloc_pd Fail(%s)", strerror(errno));
         return nullptr;
     }
-    std::unique_ptr<RDMAProxyContext> proxy_context =
-        std::unique_ptr<RDMAProxyContext>(new RDMAProxyContext(conn, logger));
+    if (options.reactor) {
+        // 发送与接收共用reactor中某个轮询线程的CQ，其生命周期只由reactor管理
+        if ((proxy_context->send_complete_queue = options.reactor->AttachCQ(
+                 conn->verbs, options.send_wr_depth + options.recv_wr_depth)) == nullptr) {
+            Log(logger.get(), "reactor AttachCQ Fail");
+            return nullptr;
+        }
+        proxy_context->recv_complete_queue = proxy_context->send_complete_queue;
+    } else {
+        // 非BusyPoll模式下两个CQ共用一个completion channel
+        if (options.completion_mode != CompletionMode::BusyPoll &&
+            (proxy_context->comp_channel = ibv_create_comp_channel(conn->verbs)) == nullptr) {
+            Log(logger.get(), "ibv_create_comp_channel Fail(%s)", strerror(errno));
+            return nullptr;
+        }
+        if((proxy_context->send_complete_queue = ibv_create_cq(conn->verbs, options.send_wr_depth, nullptr,
+                                                               proxy_context->comp_channel, 0)) == nullptr) {
+            Log(logger.get(), "create send_cq Fail(%s)", strerror(errno));
+            return nullptr;
+        }
+        if((proxy_context->recv_complete_queue = ibv_create_cq(conn->verbs, options.recv_wr_depth, nullptr,
+                                                               proxy_context->comp_channel, 0)) == nullptr) {
+            Log(logger.get(), "create recv_cq Fail(%s)", strerror(errno));
+            return nullptr;
+        }
+    }
 
     if (RegisterMemoryRegion(proxy_context.get(), logger)) {
         Log(logger.get(), "RegisterMemoryRegion Fail(%s)", strerror(errno));
@@ -31,140 +66,1652 @@ std::unique_ptr<RDMAProxy> GenerateProxy(rdma_cm_id *conn, std::shared_ptr<FileL
 
     ibv_qp_init_attr qp_init_attr;
     memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-    qp_init_attr.send_cq = conn->send_cq;
-    qp_init_attr.recv_cq = conn->recv_cq;
+    qp_init_attr.send_cq = proxy_context->send_complete_queue;
+    qp_init_attr.recv_cq = proxy_context->recv_complete_queue;
     qp_init_attr.qp_type = IBV_QPT_RC;
-    qp_init_attr.cap.max_recv_wr = 30;
-    qp_init_attr.cap.max_send_wr = 30;
+    qp_init_attr.cap.max_recv_wr = options.recv_wr_depth;
+    qp_init_attr.cap.max_send_wr = options.send_wr_depth;
     qp_init_attr.cap.max_recv_sge = 1;
     qp_init_attr.cap.max_send_sge = 1;
+    qp_init_attr.cap.max_inline_data = std::min(options.max_inline_data, MAXINLINEDATA);
     
     if (rdma_create_qp(conn, conn->pd, &qp_init_attr)) {
-        Log(logger.get(), "rdma_create_qp Fail(%s)", strerror(errno));
-        return nullptr;
+        // 设备不支持所请求的内联上限时退回非内联发送
+        Log(logger.get(), "rdma_create_qp with max_inline_data %u Fail(%s)",
+            qp_init_attr.cap.max_inline_data, strerror(errno));
+        qp_init_attr.cap.max_inline_data = 0;
+        if (options.max_inline_data == 0 || rdma_create_qp(conn, conn->pd, &qp_init_attr)) {
+            Log(logger.get(), "rdma_create_qp Fail(%s)", strerror(errno));
+            return nullptr;
+        }
     }
+    // rdma_create_qp返回QP实际支持的内联上限，可能大于请求值
+    proxy_context->max_inline = std::min(qp_init_attr.cap.max_inline_data, MAXINLINEDATA);
+    proxy_context->owns_id = true;
     std::unique_ptr<RDMAProxy> proxy(new RDMAProxy(std::move(proxy_context)));
     return proxy;
 }
 
+RDMAProxyContext::~RDMAProxyContext() {
+    // GenerateProxy中途失败时，上下文可能只完成了部分初始化
+    auto ec = rdma_id->channel;
+    // rdma_destroy_qp会一并销毁rdma_id上登记的CQ，而CQ由本连接或reactor自行管理，须先解除登记
+    rdma_id->send_cq = nullptr;
+    rdma_id->recv_cq = nullptr;
+    if (rdma_id->qp != nullptr) {
+        rdma_destroy_qp(rdma_id);
+    }
+    if (options.reactor) {
+        if (send_complete_queue != nullptr) {
+            options.reactor->DetachCQ(send_complete_queue, max_send_cqe + max_recv_cqe);
+        }
+    } else if ((send_complete_queue != nullptr && ibv_destroy_cq(send_complete_queue)) ||
+               (recv_complete_queue != nullptr && ibv_destroy_cq(recv_complete_queue))) {
+        Log(logger.get(), "~RDMAProxyContext() ibv_destroy_cq Fail(%s)", strerror(errno));
+    }
+    if (comp_channel != nullptr && ibv_destroy_comp_channel(comp_channel)) {
+        Log(logger.get(), "~RDMAProxyContext() ibv_destroy_comp_channel Fail(%s)", strerror(errno));
+    }
+    if (send_mr_manager && send_mr_manager->DeregisterMR()) {
+        Log(logger.get(), "~RDMAProxyContext() send_mr_manager->DeregisterMR() Fail(%s)", strerror(errno));
+    }
+    if (recv_mr_manager && recv_mr_manager->DeregisterMR()) {
+        Log(logger.get(), "~RDMAProxyContext() recv_mr_manager->DeregisterMR() Fail(%s)", strerror(errno));
+    }
+    if (rdma_id->pd != nullptr && ibv_dealloc_pd(rdma_id->pd)) {
+        Log(logger.get(), "~RDMAProxyContext() ibv_dealloc_pd Fail(%s)", strerror(errno));
+    }
+    rdma_id->pd = nullptr;
+    if (!owns_id) {
+        return;
+    }
+    if (rdma_destroy_id(rdma_id)) {
+        Log(logger.get(), "~RDMAProxyContext() rdma_destroy_id Fail(%s)", strerror(errno));
+    }
+    if (!shared_ec) {
+        rdma_destroy_event_channel(ec);
+    }
+}
+
 int RegisterMemoryRegion(RDMAProxyContext* proxy_context, std::shared_ptr<FileLogger> logger) {
     auto conn = proxy_context->rdma_id;
-    char* send_buffer = new char[RDMABUFFERSIZE];
-    proxy_context->send_mr_manager = std::unique_ptr<MRManager>(new MRManager(logger));
-    if (proxy_context->send_mr_manager->RegisterMR(conn->pd, send_buffer, RDMABUFFERSIZE)) {
+    const RDMAProxyOptions& options = proxy_context->options;
+    // 发送缓冲区由多个生产者线程并发分配，由完成线程释放；空间耗尽时注册新的chunk
+    proxy_context->send_mr_manager = std::unique_ptr<MRManager>(new MRManager(logger, AllocPolicy::ThreadCache));
+    if (proxy_context->send_mr_manager->RegisterArena(conn->pd, options.arena_chunk_size,
+                                                      options.arena_max_chunks, options.use_hugepage)) {
         Log(logger.get(), "reg send_mr Fail(%s)", strerror(errno));
         return -1;
     }
-    char* recv_buffer = new char[RDMABUFFERSIZE];
-    proxy_context->recv_mr_manager = std::unique_ptr<MRManager>(new MRManager(logger));
-    if (proxy_context->recv_mr_manager->RegisterMR(conn->pd, recv_buffer, RDMABUFFERSIZE)) {
+    // 接收缓冲区槽在初始化时一次性切分，之后的增长用于重组分片与READ大消息
+    proxy_context->recv_mr_manager = std::unique_ptr<MRManager>(new MRManager(logger, AllocPolicy::SizeClass));
+    if (proxy_context->recv_mr_manager->RegisterArena(conn->pd, options.arena_chunk_size,
+                                                      options.arena_max_chunks, options.use_hugepage)) {
         Log(logger.get(), "reg recv_mr Fail(%s)", strerror(errno));
         return -1;
     }
+    proxy_context->send_wr_pool = std::unique_ptr<SendWRPool>(new SendWRPool(proxy_context->max_send_cqe));
+    proxy_context->recv_wr_pool = std::unique_ptr<RecvWRPool>(new RecvWRPool());
+    if (proxy_context->recv_wr_pool->Init(proxy_context->recv_mr_manager.get(),
+                                          proxy_context->max_recv_cqe, options.recv_slot_size)) {
+        Log(logger.get(), "init recv_wr_pool Fail");
+        return -1;
+    }
     return 0;
 }
 RDMAProxy::RDMAProxy(std::unique_ptr<RDMAProxyContext> context)
-         : context_(std::move(context)) {
-    poll_cq_thread = std::thread(&RDMAProxy::PollCQ, this);
-    for (int i = 0; i < context_->max_recv_cqe; i++) {
-        PostRecv();
+         : context_(std::move(context)),
+           recv_msg_queue_(context_->options.recv_queue_size) {
+    memset(&local_info_, 0, sizeof(local_info_));
+    local_info_.recv_slot_size = context_->recv_wr_pool->SlotSize();
+    local_info_.recv_depth = context_->recv_wr_pool->Depth();
+    // 两个位置槽：前者由对端写入其对本端写入记录的消费位置，后者为本端写回对端的源缓冲区
+    MRManager* recv_mr = context_->recv_mr_manager.get();
+    char* head = recv_mr->AllocateBuffer(2 * sizeof(uint64_t));
+    if (head != nullptr) {
+        ring_head_in_ = (uint64_t*)head;
+        ring_head_out_ = (uint64_t*)head + 1;
+        *ring_head_in_ = 0;
+        *ring_head_out_ = 0;
+        local_info_.head_addr = (uintptr_t)ring_head_in_;
+        local_info_.head_rkey = recv_mr->RKey(head);
+    }
+    // 记录按8字节对齐
+    uint32_t ring_size = (context_->options.ring_size + 7) & ~7u;
+    if (ring_size > 0 && head != nullptr) {
+        ring_ = recv_mr->AllocateBuffer(ring_size);
+        if (ring_ == nullptr) {
+            Log(context_->logger.get(), "RDMAProxy AllocateBuffer ring(%u) Fail, ring disabled", ring_size);
+        } else {
+            ring_size_ = ring_size;
+            local_info_.ring_addr = (uintptr_t)ring_;
+            local_info_.ring_size = ring_size_;
+            local_info_.ring_rkey = recv_mr->RKey(ring_);
+        }
+    }
+    // 对端未告知其接收队列深度前假定与本端一致
+    send_credits_ = context_->recv_wr_pool->Depth();
+    credit_threshold_ = std::max<uint32_t>(context_->recv_wr_pool->Depth() / 2, MINCREDITTHRESHOLD);
+    // 每个描述符回收前不会被再次提交，容量取两倍深度以容纳回收途中被重新提交的描述符
+    size_t ring_sz = 2;
+    while (ring_sz < 2 * context_->send_wr_pool->Depth()) ring_sz <<= 1;
+    send_ring_.reset(new SendDesc*[ring_sz]);
+    send_ring_mask_ = ring_sz - 1;
+    send_callbacks_.reset(new SendCallback[context_->send_wr_pool->Depth()]);
+    if (context_->options.latency_stats) {
+        latency_.reset(new LatencyHistogram[(size_t)LatencyKind::Count]);
+        send_post_ns_.reset(new uint64_t[context_->send_wr_pool->Depth()]());
+        last_dump_ns_ = MonotonicNs();
+    }
+    if (context_->options.reactor) {
+        context_->options.reactor->Register(this);
+    }
+    // 一次性提交全部接收请求
+    std::vector<RecvDesc*> descs;
+    for (uint32_t i = 0; i < context_->recv_wr_pool->Depth(); i++) {
+        descs.push_back(context_->recv_wr_pool->At(i));
+    }
+    PostRecvChain(descs.data(), descs.size());
+    wc_.resize(std::max<uint32_t>(context_->options.poll_batch, 1));
+    poll_start_ = std::chrono::steady_clock::now();
+    if (!context_->options.reactor) {
+        poll_cq_thread = std::thread(&RDMAProxy::PollCQ, this);
     }
 }
 RDMAProxy::~RDMAProxy() {
     closing = true;
     Disconnect();
-    wait_disconnected_thread.join();
-    poll_cq_thread.join();
+    if (context_->options.reactor) {
+        // 共享CQ按qp_num分发，须等待本连接的冲刷事件全部取回后再停止分发，
+        // 否则残留事件可能被分发给复用该qp_num的新连接
+        DrainQP();
+        context_->options.reactor->Unregister(this);
+    } else {
+        // 未经Detach的连接，如建立失败时，没有等待断开的线程
+        if (wait_disconnected_thread.joinable()) {
+            wait_disconnected_thread.join();
+        }
+        poll_cq_thread.join();
+    }
+    // 未取得完成事件的异步发送以冲刷状态回调
+    FinishBatch();
+    for (size_t i = send_head_.load(); i != send_tail_.load(); i++) {
+        SendCallback& cb = send_callbacks_[WrIndexOf(send_ring_[i & send_ring_mask_]->wr.wr_id)];
+        if (cb) cb(IBV_WC_WR_FLUSH_ERR);
+    }
+    for (auto& it : rendezvous_) {
+        if (it.second.cb) it.second.cb(IBV_WC_WR_FLUSH_ERR);
+    }
+    for (ibv_mr* mr : local_mrs_) {
+        if (ibv_dereg_mr(mr)) {
+            Log(context_->logger.get(), "~RDMAProxy() ibv_dereg_mr Fail(%s)", strerror(errno));
+        }
+    }
     Log(context_->logger.get(), "~RDMAProxy() Done"); 
 }
 
 int RDMAProxy::SendMessage(const std::string& msg) {
-    uint64_t wr_id = request_id_.fetch_add(1);
-    Log(context_->logger.get(), "SEND Msg(%d)  : %s", wr_id, msg.c_str());  
-    auto wr_wrapper = context_->send_mr_manager->AllocateSendWR(wr_id, msg);
-    if (wr_wrapper == nullptr) {
-        Log(context_->logger.get(), "SendMessage(%s): AllocateWR Fail", msg.c_str());
+    return SendMessageAsync(msg, nullptr);
+}
+
+int RDMAProxy::SendMessageAsync(const std::string& msg, SendCallback cb) {
+    if (sizeof(MsgHeader) + msg.size() <= context_->max_inline) {
+        return SendInline(msg.data(), msg.size(), std::move(cb));
+    }
+    SendBuffer buffer;
+    if (ReserveSend(msg.size(), &buffer)) {
+        Log(context_->logger.get(), "SendMessage(%lu): ReserveSend Fail", msg.size());
+        return -1;
+    }
+    memcpy(buffer.data, msg.data(), msg.size());
+    return CommitSendAsync(&buffer, msg.size(), std::move(cb));
+}
+
+std::future<ibv_wc_status> RDMAProxy::SendMessageAsync(const std::string& msg) {
+    auto promise = std::make_shared<std::promise<ibv_wc_status>>();
+    std::future<ibv_wc_status> future = promise->get_future();
+    if (SendMessageAsync(msg, [promise](ibv_wc_status status) { promise->set_value(status); })) {
+        promise->set_value(IBV_WC_GENERAL_ERR);
+    }
+    return future;
+}
+
+int RDMAProxy::ReserveSend(uint32_t sz, SendBuffer* buffer) {
+    SendDesc* desc = nullptr;
+    if (sz <= MaxFragment()) {
+        desc = AcquireSendDesc(context_->options.blocking_send);
+        if (desc == nullptr) {
+            Log(context_->logger.get(), "ReserveSend(%u): Send queue full", sz);
+            return -1;
+        }
+    }
+    if (ReserveSendBuffer(sz, buffer)) {
+        if (desc != nullptr) context_->send_wr_pool->Release(desc);
+        return -1;
+    }
+    buffer->desc = desc;
+    return 0;
+}
+
+int RDMAProxy::ReserveSendBuffer(uint32_t sz, SendBuffer* buffer) {
+    bool blocking = context_->options.blocking_send;
+    // 帧头位于data之前，单个分片的消息可原地发送
+    char* frame = context_->send_mr_manager->AllocateBuffer(sizeof(MsgHeader) + sz);
+    if (frame == nullptr) {
+        send_buffer_stalls_.fetch_add(1, std::memory_order_relaxed);
+        // 仅当有发送缓冲区尚待释放时等待
+        if (blocking) {
+            WaitSend([&] {
+                frame = context_->send_mr_manager->AllocateBuffer(sizeof(MsgHeader) + sz);
+                return frame != nullptr || !SendPending();
+            });
+        }
+    }
+    if (frame == nullptr) {
+        Log(context_->logger.get(), "ReserveSend(%u): AllocateBuffer Fail", sz);
+        return -1;
+    }
+    buffer->data = frame + sizeof(MsgHeader);
+    buffer->capacity = sz;
+    buffer->desc = nullptr;
+    return 0;
+}
+
+int RDMAProxy::CommitSend(SendBuffer* buffer, uint32_t len) {
+    return CommitSendAsync(buffer, len, nullptr);
+}
+
+int RDMAProxy::CommitSendAsync(SendBuffer* buffer, uint32_t len, SendCallback cb) {
+    if (buffer->data == nullptr || len > buffer->capacity) {
+        Log(context_->logger.get(), "CommitSend(%u): Invalid buffer (capacity %u)", len, buffer->capacity);
+        AbortSend(buffer);
+        return -1;
+    }
+    bool blocking = context_->options.blocking_send;
+    char* frame = buffer->data - sizeof(MsgHeader);
+    if (len <= MaxFragment()) {
+        if (buffer->desc == nullptr && (buffer->desc = AcquireSendDesc(blocking)) == nullptr) {
+            AbortSend(buffer);
+            return -1;
+        }
+        if (!AcquireCredit(blocking, false)) {
+            AbortSend(buffer);
+            return -1;
+        }
+        MsgHeader* header = (MsgHeader*)frame;
+        header->msg_id = next_msg_id_.fetch_add(1);
+        header->offset = 0;
+        header->total = len;
+        header->type = FrameType::Data;
+        if (cb) SetSendCallback(buffer->desc, std::move(cb));
+        if (PostFrame(buffer->desc, frame, sizeof(MsgHeader) + len)) {
+            SetSendCallback(buffer->desc, nullptr);
+            AbortSend(buffer);
+            return -1;
+        }
+        // 缓冲区的所有权已移交给完成线程
+        *buffer = SendBuffer();
+        CountSent(len);
+        return 0;
+    }
+    if (buffer->desc != nullptr) {
+        context_->send_wr_pool->Release(buffer->desc);
+        buffer->desc = nullptr;
+    }
+    // 能写入对端接收环的消息无需分片或由对端READ
+    if (RingFits(len) && SendRing(frame, len, cb) == 0) {
+        *buffer = SendBuffer();
+        CountSent(len);
+        return 0;
+    }
+    int ret;
+    if (len <= context_->options.rendezvous_threshold) {
+        ret = SendFragments(buffer->data, len, std::move(cb));
+        context_->send_mr_manager->ReleaseBuffer(frame);
+    } else {
+        ret = SendRendezvous(frame, len, std::move(cb));
+        if (ret) context_->send_mr_manager->ReleaseBuffer(frame);
+    }
+    *buffer = SendBuffer();
+    if (ret == 0) CountSent(len);
+    return ret;
+}
+
+void RDMAProxy::AbortSend(SendBuffer* buffer) {
+    if (buffer->data != nullptr) {
+        context_->send_mr_manager->ReleaseBuffer(buffer->data - sizeof(MsgHeader));
+    }
+    if (buffer->desc != nullptr) {
+        // 描述符可能已由FillFrame填写，经RecycleSendDesc复位其标志与回调；缓冲区已在上面归还
+        buffer->desc->addr = nullptr;
+        RecycleSendDesc(buffer->desc);
+    }
+    *buffer = SendBuffer();
+}
+
+SendDesc* RDMAProxy::AcquireSendDesc(bool wait) {
+    SendDesc* desc = context_->send_wr_pool->Acquire();
+    if (desc != nullptr) {
+        return desc;
+    }
+    send_desc_stalls_.fetch_add(1, std::memory_order_relaxed);
+    if (!wait || !WaitSend([&] { return (desc = context_->send_wr_pool->Acquire()) != nullptr; })) {
+        return nullptr;
+    }
+    return desc;
+}
+
+bool RDMAProxy::AcquireCredit(bool wait, bool update) {
+    int32_t reserve = update ? 0 : 1;
+    auto take = [&] {
+        int32_t credits = send_credits_.load();
+        while (credits > reserve) {
+            if (send_credits_.compare_exchange_weak(credits, credits - 1)) {
+                return true;
+            }
+        }
+        return false;
+    };
+    if (take()) {
+        return true;
+    }
+    credit_stalls_.fetch_add(1, std::memory_order_relaxed);
+    return wait && WaitSend(take);
+}
+
+bool RDMAProxy::WaitSend(const std::function<bool()>& ready) {
+    for (uint32_t i = 0; i < SENDSPINCOUNT; i++) {
+        if (ready()) {
+            return true;
+        }
+        if (!IsActive()) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    while (true) {
+        std::unique_lock<std::mutex> lock(send_wait_mtx_);
+        send_parked_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // 登记后再检查一次，与完成线程的先释放资源后检查send_parked_配对，避免丢失唤醒
+        bool ok = ready();
+        if (ok || !IsActive()) {
+            send_parked_.fetch_sub(1);
+            return ok;
+        }
+        // 完成线程之外释放的资源与连接关闭不会唤醒等待者，限时后重新检查
+        send_cv_.wait_for(lock, std::chrono::microseconds(SENDWAITUS));
+        send_parked_.fetch_sub(1);
+    }
+}
+
+void RDMAProxy::NotifySend() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (send_parked_.load() > 0) {
+        std::unique_lock<std::mutex> lock(send_wait_mtx_);
+        send_cv_.notify_all();
+    }
+}
+
+void RDMAProxy::ReturnCredits() {
+    if (credits_to_return_.load() >= credit_threshold_ && !closing) {
+        PostControl(FrameType::Credit, 0, nullptr, 0, false);
+    }
+}
+
+int RDMAProxy::SendInline(const char* data, uint32_t len, SendCallback cb) {
+    bool blocking = context_->options.blocking_send;
+    SendDesc* desc = AcquireSendDesc(blocking);
+    if (desc == nullptr) {
+        Log(context_->logger.get(), "SendInline(%u): Send queue full", len);
+        return -1;
+    }
+    if (!AcquireCredit(blocking, false)) {
+        Log(context_->logger.get(), "SendInline(%u): No credit", len);
+        context_->send_wr_pool->Release(desc);
         return -1;
     }
+    alignas(8) char frame[MAXINLINEDATA];
+    MsgHeader* header = (MsgHeader*)frame;
+    header->msg_id = next_msg_id_.fetch_add(1);
+    header->offset = 0;
+    header->total = len;
+    header->type = FrameType::Data;
+    memcpy(frame + sizeof(MsgHeader), data, len);
+    // 内联帧在ibv_post_send返回时已被拷贝，无需lkey
+    desc->addr = nullptr;
+    desc->sge.addr = (uintptr_t)frame;
+    desc->sge.length = sizeof(MsgHeader) + len;
+    desc->sge.lkey = 0;
+    desc->wr.send_flags |= IBV_SEND_INLINE;
+    if (cb) SetSendCallback(desc, std::move(cb));
+    LogDebug(context_->logger.get(), "SEND Msg(%d) inline, len:%u", WrIndexOf(desc->wr.wr_id), desc->sge.length);
+    if (PostSendChain(&desc, 1) != 1) {
+        RecycleSendDesc(desc);
+        return -1;
+    }
+    CountSent(len);
+    return 0;
+}
+
+void RDMAProxy::FillFrame(SendDesc* desc, char* frame, uint32_t len) {
+    desc->addr = frame;
+    desc->sge.addr = (uintptr_t)frame;
+    desc->sge.length = len;
+    desc->sge.lkey = context_->send_mr_manager->LKey(frame);
+    // 描述符可能来自未经复位的路径，按本帧的长度显式设置
+    if (len <= context_->max_inline) {
+        desc->wr.send_flags |= IBV_SEND_INLINE;
+    } else {
+        desc->wr.send_flags &= ~IBV_SEND_INLINE;
+    }
+    LogDebug(context_->logger.get(), "SEND Msg(%d), len:%u", WrIndexOf(desc->wr.wr_id), len);
+}
+
+int RDMAProxy::PostFrame(SendDesc* desc, char* frame, uint32_t len) {
+    FillFrame(desc, frame, len);
+    return PostSendChain(&desc, 1) == 1 ? 0 : -1;
+}
+
+size_t RDMAProxy::PostSendChain(SendDesc** descs, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock(send_mtx_);
+    if (peer_ring_size_ > 0) {
+        for (size_t i = 0; i < n; i++) {
+            RingReserve(descs[i]);
+        }
+    }
+    size_t posted = PostSendChainLocked(descs, n);
+    // 未提交的描述符可能由调用方直接放回描述符池，须恢复为SEND；其占用的credit一并归还
+    for (size_t i = posted; i < n; i++) {
+        if (descs[i]->wr.opcode == IBV_WR_RDMA_WRITE_WITH_IMM) descs[i]->wr.opcode = IBV_WR_SEND;
+        if (descs[i]->wr.opcode == IBV_WR_SEND) send_credits_.fetch_add(1);
+    }
+    return posted;
+}
+
+size_t RDMAProxy::PostSendChainLocked(SendDesc** descs, size_t n) {
+    uint32_t interval = std::max<uint32_t>(context_->options.signal_interval, 1);
+    // 内联帧在提交后即可释放，提交前从描述符上摘下以免完成线程重复释放
+    std::vector<char*>& inlined = send_inlined_;
+    inlined.assign(n, nullptr);
+    for (size_t i = 0; i < n; i++) {
+        if ((descs[i]->wr.send_flags & IBV_SEND_INLINE) && descs[i]->addr != nullptr) {
+            inlined[i] = descs[i]->addr;
+            descs[i]->addr = nullptr;
+        }
+    }
+    // 将待归还的credit捎带在第一个SEND或WRITE_WITH_IMM帧中
+    size_t stamped = n;
+    uint32_t credits = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (descs[i]->wr.opcode != IBV_WR_SEND && descs[i]->wr.opcode != IBV_WR_RDMA_WRITE_WITH_IMM) continue;
+        MsgHeader* header = (MsgHeader*)descs[i]->sge.addr;
+        header->credits = 0;
+        if (stamped == n) {
+            stamped = i;
+            credits = credits_to_return_.exchange(0);
+            if (credits > UINT16_MAX) {
+                credits_to_return_.fetch_add(credits - UINT16_MAX);
+                credits = UINT16_MAX;
+            }
+            header->credits = credits;
+        }
+    }
+    size_t signaled = 0;
+    size_t tail = send_tail_.load(std::memory_order_relaxed);
+    uint64_t now = latency_ ? MonotonicNs() : 0;
+    for (size_t i = 0; i < n; i++) {
+        SendDesc* desc = descs[i];
+        if (latency_) send_post_ns_[WrIndexOf(desc->wr.wr_id)] = now;
+        // 描述符耗尽时必须请求通知，否则等待描述符的线程无法被唤醒
+        // 带有回调的WR须单独取得完成事件，否则位于末尾时回调可能不会被调用
+        bool signal = ++unsignaled_ >= interval
+                      || (n > 1 && i + 1 == n)
+                      || desc->wr.opcode == IBV_WR_RDMA_READ
+                      || send_callbacks_[WrIndexOf(desc->wr.wr_id)]
+                      || context_->send_wr_pool->Available() == 0;
+        if (signal) {
+            desc->wr.send_flags |= IBV_SEND_SIGNALED;
+            unsignaled_ = 0;
+            signaled++;
+        } else {
+            desc->wr.send_flags &= ~IBV_SEND_SIGNALED;
+        }
+        if (i + 1 < n) desc->wr.next = &descs[i + 1]->wr;
+        send_ring_[(tail + i) & send_ring_mask_] = desc;
+    }
+    send_tail_.store(tail + n, std::memory_order_release);
     ibv_send_wr* bad_wr = nullptr;
-    if(ibv_post_send(context_->rdma_id->qp, wr_wrapper->wr, &bad_wr)) {
-        Log(context_->logger.get(), "ibv_post_send msg Fail(%s) : %s", strerror(errno), msg.c_str());
+    size_t posted = n;
+    if (ibv_post_send(context_->rdma_id->qp, &descs[0]->wr, &bad_wr)) {
+        Log(context_->logger.get(), "ibv_post_send msg(%d) Fail(%s)", WrIndexOf(bad_wr->wr_id), strerror(errno));
+        post_failures_.fetch_add(1, std::memory_order_relaxed);
+        posted = 0;
+        while (posted < n && &descs[posted]->wr != bad_wr) posted++;
+        // 撤回未提交的描述符，它们位于所有已提交描述符之后，不会被完成线程访问
+        send_tail_.store(tail + posted, std::memory_order_release);
+        signaled = 0;
+        for (size_t i = 0; i < posted; i++) {
+            if (descs[i]->wr.send_flags & IBV_SEND_SIGNALED) signaled++;
+        }
+    }
+    // 提交后WR已被拷贝至发送队列，可立即拆开链表
+    for (size_t i = 0; i + 1 < n; i++) {
+        descs[i]->wr.next = nullptr;
+    }
+    in_flight_tasks_.fetch_add(signaled);
+    if (stamped >= posted && credits > 0) {
+        credits_to_return_.fetch_add(credits);
+    }
+    size_t released = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (inlined[i] == nullptr) continue;
+        if (i < posted) {
+            inlined[released++] = inlined[i];
+        } else {
+            // 未提交的描述符由调用方连同缓冲区一并回收
+            descs[i]->addr = inlined[i];
+        }
+    }
+    if (released > 0) {
+        context_->send_mr_manager->ReleaseBuffers(inlined.data(), released);
+    }
+    return posted;
+}
+
+void RDMAProxy::ReclaimSends(SendDesc* last, ibv_wc_status status) {
+    size_t head = send_head_.load(std::memory_order_relaxed);
+    size_t tail = send_tail_.load(std::memory_order_acquire);
+    uint64_t now = latency_ && status == IBV_WC_SUCCESS ? MonotonicNs() : 0;
+    while (head != tail) {
+        SendDesc* desc = send_ring_[head & send_ring_mask_];
+        head++;
+        if (now != 0) {
+            LatencyKind kind;
+            switch (desc->wr.opcode) {
+                case IBV_WR_RDMA_WRITE_WITH_IMM: kind = LatencyKind::RingWrite; break;
+                case IBV_WR_RDMA_WRITE: kind = LatencyKind::Write; break;
+                case IBV_WR_RDMA_READ: kind = LatencyKind::Read; break;
+                case IBV_WR_ATOMIC_FETCH_AND_ADD:
+                case IBV_WR_ATOMIC_CMP_AND_SWP: kind = LatencyKind::Atomic; break;
+                default: kind = LatencyKind::Send; break;
+            }
+            latency_[(size_t)kind].Record(now - send_post_ns_[WrIndexOf(desc->wr.wr_id)]);
+        }
+        if (desc->addr != nullptr &&
+            (desc->wr.opcode == IBV_WR_SEND || desc->wr.opcode == IBV_WR_RDMA_WRITE_WITH_IMM)) {
+            send_release_.push_back(desc->addr);
+            desc->addr = nullptr;
+        }
+        SendCallback& cb = send_callbacks_[WrIndexOf(desc->wr.wr_id)];
+        if (cb) {
+            send_done_.emplace_back(std::move(cb), desc == last ? status : IBV_WC_SUCCESS);
+            cb = nullptr;
+        }
+        RecycleSendDesc(desc);
+        if (desc == last) break;
+    }
+    send_head_.store(head, std::memory_order_release);
+}
+
+int RDMAProxy::CommitSendBatch(SendBuffer* buffers, const uint32_t* lens, size_t n) {
+    bool blocking = context_->options.blocking_send;
+    int ret = 0;
+    std::vector<SendDesc*> chain;
+    chain.reserve(n);
+    // 提交并清空当前累积的WR链
+    auto flush = [&]() {
+        size_t posted = PostSendChain(chain.data(), chain.size());
+        for (size_t i = posted; i < chain.size(); i++) {
+            RecycleSendDesc(chain[i]);
+            ret = -1;
+        }
+        chain.clear();
+    };
+    for (size_t i = 0; i < n; i++) {
+        SendBuffer* buffer = &buffers[i];
+        uint32_t len = lens[i];
+        if (buffer->data == nullptr || len > buffer->capacity || len > MaxFragment()) {
+            // 多分片或无效的消息保持原有顺序单独提交
+            flush();
+            if (CommitSend(buffer, len)) ret = -1;
+            continue;
+        }
+        // 描述符不足时先提交已串联的帧，它们完成后描述符才会被回收
+        if (buffer->desc == nullptr && (buffer->desc = AcquireSendDesc(false)) == nullptr) {
+            flush();
+            if ((buffer->desc = AcquireSendDesc(blocking)) == nullptr) {
+                AbortSend(buffer);
+                ret = -1;
+                continue;
+            }
+        }
+        // credit不足时先提交已串联的帧，对端收到后才可能归还credit
+        if (!AcquireCredit(false, false)) {
+            flush();
+            if (!AcquireCredit(blocking, false)) {
+                AbortSend(buffer);
+                ret = -1;
+                continue;
+            }
+        }
+        char* frame = buffer->data - sizeof(MsgHeader);
+        MsgHeader* header = (MsgHeader*)frame;
+        header->msg_id = next_msg_id_.fetch_add(1);
+        header->offset = 0;
+        header->total = len;
+        header->type = FrameType::Data;
+        FillFrame(buffer->desc, frame, sizeof(MsgHeader) + len);
+        chain.push_back(buffer->desc);
+        *buffer = SendBuffer();
+    }
+    flush();
+    return ret;
+}
+
+int RDMAProxy::SendBatch(const std::vector<std::string>& msgs) {
+    std::vector<SendBuffer> buffers(msgs.size());
+    std::vector<uint32_t> lens(msgs.size());
+    // 只预留缓冲区，描述符由CommitSendBatch按需获取，否则批量超过发送队列深度时预留无法完成
+    for (size_t i = 0; i < msgs.size(); i++) {
+        if (ReserveSendBuffer(msgs[i].size(), &buffers[i])) {
+            Log(context_->logger.get(), "SendBatch(%lu): ReserveSend Fail", msgs.size());
+            for (size_t j = 0; j < i; j++) {
+                AbortSend(&buffers[j]);
+            }
+            return -1;
+        }
+        memcpy(buffers[i].data, msgs[i].data(), msgs[i].size());
+        lens[i] = msgs[i].size();
+    }
+    return CommitSendBatch(buffers.data(), lens.data(), msgs.size());
+}
+
+int RDMAProxy::SendFragments(const char* data, uint32_t len, SendCallback cb) {
+    uint32_t msg_id = next_msg_id_.fetch_add(1);
+    uint32_t fragment = MaxFragment();
+    std::vector<SendDesc*> chain;
+    uint32_t offset = 0;
+    bool started = false;  // 已有分片提交，对端为该消息建立了重组缓冲区
+    // 分片依次进入发送队列，无需等待前一个分片完成；每次将当前可用的描述符串联后一并提交
+    while (offset < len) {
+        // 首个分片按blocking_send获取描述符与credit，其后只串联现有的，不足时先提交已串联的分片；
+        // 已有分片提交后总是等待，否则对端的重组无法完成
+        bool wait = context_->options.blocking_send || offset > 0;
+        SendDesc* desc = AcquireSendDesc(wait);
+        if (desc != nullptr && !AcquireCredit(wait, false)) {
+            context_->send_wr_pool->Release(desc);
+            desc = nullptr;
+        }
+        bool stalled = desc == nullptr;
+        while (desc != nullptr) {
+            uint32_t n = std::min(fragment, len - offset);
+            char* frame = context_->send_mr_manager->AllocateBuffer(sizeof(MsgHeader) + n);
+            // 已串联的分片提交后才可能释放发送缓冲区；否则仅当有尚未完成的发送时等待
+            if (frame == nullptr && chain.empty() && wait) {
+                WaitSend([&] {
+                    frame = context_->send_mr_manager->AllocateBuffer(sizeof(MsgHeader) + n);
+                    return frame != nullptr || !SendPending();
+                });
+            }
+            if (frame == nullptr) {
+                context_->send_wr_pool->Release(desc);
+                send_credits_.fetch_add(1);
+                stalled = chain.empty();
+                break;
+            }
+            MsgHeader* header = (MsgHeader*)frame;
+            header->msg_id = msg_id;
+            header->offset = offset;
+            header->total = len;
+            header->type = FrameType::Data;
+            memcpy(frame + sizeof(MsgHeader), data + offset, n);
+            FillFrame(desc, frame, sizeof(MsgHeader) + n);
+            if (offset + n == len && cb) SetSendCallback(desc, std::move(cb));
+            chain.push_back(desc);
+            offset += n;
+            desc = offset < len ? context_->send_wr_pool->Acquire() : nullptr;
+            if (desc != nullptr && !AcquireCredit(false, false)) {
+                context_->send_wr_pool->Release(desc);
+                desc = nullptr;
+            }
+        }
+        size_t posted = PostSendChain(chain.data(), chain.size());
+        bool fail = posted < chain.size() || stalled;
+        started = started || posted > 0;
+        for (size_t i = posted; i < chain.size(); i++) {
+            RecycleSendDesc(chain[i]);
+        }
+        chain.clear();
+        if (fail) {
+            Log(context_->logger.get(), "SendFragments msg(%u) len:%u Fail at offset %u", msg_id, len, offset);
+            // 通知对端丢弃不会完成的重组；连接关闭时重组缓冲区随连接释放
+            if (started && IsActive() && PostControl(FrameType::Abort, msg_id, nullptr, 0, true)) {
+                Log(context_->logger.get(), "SendFragments msg(%u) Abort Fail", msg_id);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int RDMAProxy::SendRendezvous(char* frame, uint32_t len, SendCallback cb) {
+    uint32_t msg_id = next_msg_id_.fetch_add(1);
+    RendezvousInfo info;
+    info.addr = (uintptr_t)(frame + sizeof(MsgHeader));
+    info.rkey = context_->send_mr_manager->RKey(frame);
+    info.len = len;
+    {
+        std::unique_lock<std::mutex> lock(rendezvous_mtx_);
+        PendingRendezvous& pending = rendezvous_[msg_id];
+        pending.frame = frame;
+        pending.cb = std::move(cb);
+    }
+    if (PostControl(FrameType::RendezvousRequest, msg_id, &info, sizeof(info), context_->options.blocking_send)) {
+        std::unique_lock<std::mutex> lock(rendezvous_mtx_);
+        rendezvous_.erase(msg_id);
+        return -1;
+    }
+    return 0;
+}
+
+bool RDMAProxy::RingReserve(SendDesc* desc) {
+    if (desc->wr.opcode != IBV_WR_SEND) {
+        return false;
+    }
+    MsgHeader* header = (MsgHeader*)desc->sge.addr;
+    if (header->type != FrameType::Data || header->offset != 0 ||
+        sizeof(MsgHeader) + header->total != desc->sge.length || !RingFits(header->total)) {
+        return false;
+    }
+    uint64_t size = peer_ring_size_;
+    uint64_t record = (desc->sge.length + 7) & ~7ull;
+    uint64_t pos = peer_ring_tail_ % size;
+    // 记录不跨越环的末尾，剩余的空间被跳过
+    uint64_t skip = pos + record > size ? size - pos : 0;
+    uint64_t head = *(volatile uint64_t*)ring_head_in_;
+    if (peer_ring_tail_ + skip + record - head > size) {
+        return false;
+    }
+    pos = (pos + skip) % size;
+    peer_ring_tail_ += skip + record;
+    desc->wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    desc->wr.imm_data = htonl(pos / 8);
+    desc->wr.wr.rdma.remote_addr = peer_ring_addr_ + pos;
+    desc->wr.wr.rdma.rkey = peer_ring_rkey_;
+    return true;
+}
+
+int RDMAProxy::SendRing(char* frame, uint32_t len, SendCallback& cb) {
+    SendDesc* desc = AcquireSendDesc(context_->options.blocking_send);
+    if (desc == nullptr) {
+        return -1;
+    }
+    // 写入记录同样消耗对端的一个接收请求
+    if (!AcquireCredit(context_->options.blocking_send, false)) {
+        context_->send_wr_pool->Release(desc);
+        return -1;
+    }
+    MsgHeader* header = (MsgHeader*)frame;
+    header->msg_id = next_msg_id_.fetch_add(1);
+    header->offset = 0;
+    header->total = len;
+    header->type = FrameType::Data;
+    FillFrame(desc, frame, sizeof(MsgHeader) + len);
+    size_t idx = WrIndexOf(desc->wr.wr_id);
+    std::unique_lock<std::mutex> lock(send_mtx_);
+    if (RingReserve(desc)) {
+        if (cb) send_callbacks_[idx] = std::move(cb);
+        if (PostSendChainLocked(&desc, 1) == 1) {
+            return 0;
+        }
+        // 已分配的位置不再收回，对端将其视为被跳过的空间
+        if (send_callbacks_[idx]) cb = std::move(send_callbacks_[idx]);
+    }
+    lock.unlock();
+    // 接收环空间不足时由调用方退回其他方式发送
+    send_credits_.fetch_add(1);
+    desc->addr = nullptr;
+    RecycleSendDesc(desc);
+    return -1;
+}
+
+void RDMAProxy::HandleRingRecord(RecvDesc* desc, uint32_t imm, uint32_t byte_len) {
+    // 接收请求的缓冲区未被使用，可立即重新提交
+    RepostRecv(desc);
+    uint64_t offset = (uint64_t)imm * 8;
+    if (ring_size_ == 0 || byte_len < sizeof(MsgHeader) || offset + byte_len > ring_size_) {
+        Log(context_->logger.get(), "RING record offset:%lu, len:%u Invalid", offset, byte_len);
+        return;
+    }
+    MsgHeader header;
+    memcpy(&header, ring_ + offset, sizeof(header));
+    if (header.credits > 0) {
+        send_credits_.fetch_add(header.credits);
+    }
+    uint32_t len = byte_len - sizeof(MsgHeader);
+    LogDebug(context_->logger.get(), "RING Msg(%u) offset:%lu, len:%u", header.msg_id, offset, len);
+    if (header.type != FrameType::Data || header.total != len) {
+        Log(context_->logger.get(), "RING Msg(%u) Invalid frame type %d", header.msg_id, (int)header.type);
+        return;
+    }
+    {
+        // 记录按写入顺序到达，偏移之前被对端跳过的空间计入本记录
+        std::unique_lock<std::mutex> lock(ring_mtx_);
+        RingRecord record;
+        record.begin = ring_tail_ + (offset + ring_size_ - ring_tail_ % ring_size_) % ring_size_;
+        record.end = record.begin + ((byte_len + 7) & ~7ull);
+        record.released = false;
+        ring_records_.push_back(record);
+        ring_tail_ = record.end;
+    }
+    RecvBuffer buffer;
+    buffer.data = ring_ + offset + sizeof(MsgHeader);
+    buffer.len = len;
+    EnqueueRecv(buffer);
+}
+
+void RDMAProxy::ReleaseRingRecord(const char* data) {
+    uint64_t offset = data - sizeof(MsgHeader) - ring_;
+    {
+        std::unique_lock<std::mutex> lock(ring_mtx_);
+        for (RingRecord& record : ring_records_) {
+            if (!record.released && record.begin % ring_size_ == offset) {
+                record.released = true;
+                break;
+            }
+        }
+        while (!ring_records_.empty() && ring_records_.front().released) {
+            ring_records_.pop_front();
+        }
+        ring_head_ = ring_records_.empty() ? ring_tail_ : ring_records_.front().begin;
+    }
+    // 延迟写回，对端仅在空间不足时才需要新的位置
+    if (ring_head_.load() - ring_reported_.load() >= ring_size_ / 4) {
+        ReportRingHead();
+    }
+}
+
+void RDMAProxy::ReportRingHead() {
+    std::unique_lock<std::mutex> lock(ring_mtx_);
+    uint64_t head = ring_head_.load();
+    if (closing || peer_head_addr_ == 0 || head == ring_reported_.load()) {
+        return;
+    }
+    SendDesc* desc = context_->send_wr_pool->Acquire();
+    if (desc == nullptr) {
+        // 由FlushDeferred重试
+        return;
+    }
+    *ring_head_out_ = head;
+    desc->one_sided = true;
+    desc->wr.opcode = IBV_WR_RDMA_WRITE;
+    desc->wr.wr.rdma.remote_addr = peer_head_addr_;
+    desc->wr.wr.rdma.rkey = peer_head_rkey_;
+    desc->sge.addr = (uintptr_t)ring_head_out_;
+    desc->sge.length = sizeof(uint64_t);
+    desc->sge.lkey = context_->recv_mr_manager->LKey((char*)ring_head_out_);
+    // 内联时位置在提交时即被拷贝，不会与之后的更新交错
+    if (sizeof(uint64_t) <= context_->max_inline) {
+        desc->wr.send_flags |= IBV_SEND_INLINE;
+    }
+    if (PostSendChain(&desc, 1) != 1) {
+        RecycleSendDesc(desc);
+        return;
+    }
+    ring_reported_ = head;
+}
+
+int RDMAProxy::PostControl(FrameType type, uint32_t msg_id, const void* payload, uint32_t len, bool wait) {
+    SendDesc* desc = AcquireSendDesc(wait);
+    if (desc == nullptr) {
+        return -1;
+    }
+    if (!AcquireCredit(wait, type == FrameType::Credit)) {
+        context_->send_wr_pool->Release(desc);
+        return -1;
+    }
+    // 能内联的控制帧在栈上构造，不依赖发送缓冲区，发送缓冲区耗尽时仍可发出
+    uint32_t frame_len = sizeof(MsgHeader) + len;
+    bool inlined = frame_len <= context_->max_inline;
+    alignas(8) char inline_frame[MAXINLINEDATA];
+    char* frame = inlined ? inline_frame : context_->send_mr_manager->AllocateBuffer(frame_len);
+    if (frame == nullptr) {
+        // 未发送的帧不消耗对端的接收请求
+        send_credits_.fetch_add(1);
+        context_->send_wr_pool->Release(desc);
+        return -1;
+    }
+    MsgHeader* header = (MsgHeader*)frame;
+    header->msg_id = msg_id;
+    header->offset = 0;
+    header->total = len;
+    header->type = type;
+    if (len > 0) {
+        memcpy(frame + sizeof(MsgHeader), payload, len);
+    }
+    if (inlined) {
+        desc->addr = nullptr;
+        desc->sge.addr = (uintptr_t)frame;
+        desc->sge.length = frame_len;
+        desc->sge.lkey = 0;
+        desc->wr.send_flags |= IBV_SEND_INLINE;
+        if (PostSendChain(&desc, 1) != 1) {
+            RecycleSendDesc(desc);
+            return -1;
+        }
+        return 0;
+    }
+    if (PostFrame(desc, frame, frame_len)) {
+        RecycleSendDesc(desc);
         return -1;
     }
-    in_flight_tasks_.fetch_add(1);
     return 0;
 }
 
 int RDMAProxy::RecvMessage(std::string& msg) {
-    std::unique_lock<std::mutex> lock(mtx_);
-    while (recv_msg_queue_.empty() && IsActive()) {
-        cv_.wait_for(lock, std::chrono::milliseconds(1000));
+    RecvBuffer buffer;
+    if (AcquireRecv(&buffer)) {
+        return -1;
     }
-    if (recv_msg_queue_.empty()) {
+    msg.assign(buffer.data, buffer.len);
+    ReleaseRecv(&buffer);
+    return 0;
+}
+
+int RDMAProxy::TryRecv(std::string& msg) {
+    RecvBuffer buffer;
+    if (!PopRecv(&buffer)) {
+        return -1;
+    }
+    msg.assign(buffer.data, buffer.len);
+    ReleaseRecv(&buffer);
+    return 0;
+}
+
+int RDMAProxy::RecvMessageFor(std::string& msg, uint32_t timeout_us) {
+    RecvBuffer buffer;
+    if (!WaitRecv(&buffer, std::max<uint32_t>(timeout_us, 1))) {
+        return -1;
+    }
+    msg.assign(buffer.data, buffer.len);
+    ReleaseRecv(&buffer);
+    return 0;
+}
+
+int RDMAProxy::RecvMany(std::vector<std::string>& msgs, size_t max) {
+    RecvBuffer buffer;
+    if (max == 0) {
+        return 0;
+    }
+    if (!WaitRecv(&buffer)) {
+        Log(context_->logger.get(), "RecvMany: Proxy Closing");
+        return -1;
+    }
+    int n = 0;
+    do {
+        msgs.emplace_back(buffer.data, buffer.len);
+        ReleaseRecv(&buffer);
+        n++;
+    } while ((size_t)n < max && PopRecv(&buffer));
+    return n;
+}
+
+int RDMAProxy::AcquireRecv(RecvBuffer* buffer) {
+    if (!WaitRecv(buffer)) {
         Log(context_->logger.get(), "RecvMessage: Proxy Closing");
         return -1;
     }
-    msg = recv_msg_queue_.front();
-    recv_msg_queue_.pop();
     return 0;
 }
 
+void RDMAProxy::PushRecv(const RecvBuffer& buffer) {
+    // 仅完成线程会置位overflowed_，读到false时后备队列必为空
+    if (!overflowed_.load(std::memory_order_acquire) && recv_msg_queue_.TryPush(buffer)) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(overflow_mtx_);
+    if (recv_overflow_.empty() && recv_msg_queue_.TryPush(buffer)) {
+        return;
+    }
+    recv_overflow_.push_back(buffer);
+    overflowed_.store(true, std::memory_order_release);
+}
+
+bool RDMAProxy::PopRecv(RecvBuffer* buffer) {
+    if (!TakeRecv(buffer)) {
+        return false;
+    }
+    if (latency_) {
+        uint64_t now = MonotonicNs();
+        latency_[(size_t)LatencyKind::RecvToConsumer].Record(now - buffer->complete_ns);
+        latency_[(size_t)LatencyKind::RecvQueueWait].Record(now - buffer->queued_ns);
+    }
+    return true;
+}
+
+bool RDMAProxy::TakeRecv(RecvBuffer* buffer) {
+    if (recv_msg_queue_.TryPop(*buffer)) {
+        return true;
+    }
+    if (!overflowed_.load(std::memory_order_acquire)) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(overflow_mtx_);
+    // 无锁队列已空，后备队列中的消息依次前移以保持顺序
+    if (recv_msg_queue_.TryPop(*buffer)) {
+        return true;
+    }
+    if (recv_overflow_.empty()) {
+        return false;
+    }
+    *buffer = recv_overflow_.front();
+    recv_overflow_.pop_front();
+    while (!recv_overflow_.empty() && recv_msg_queue_.TryPush(recv_overflow_.front())) {
+        recv_overflow_.pop_front();
+    }
+    if (recv_overflow_.empty()) {
+        overflowed_.store(false, std::memory_order_release);
+    }
+    return true;
+}
+
+bool RDMAProxy::WaitRecv(RecvBuffer* buffer, uint32_t timeout_us) {
+    auto start = std::chrono::steady_clock::now();
+    auto spin = std::chrono::microseconds(context_->options.recv_spin_us);
+    auto timeout = std::chrono::microseconds(timeout_us);
+    if (timeout_us > 0 && timeout < spin) {
+        spin = timeout;
+    }
+    do {
+        if (PopRecv(buffer)) {
+            return true;
+        }
+    } while (IsActive() && std::chrono::steady_clock::now() - start < spin);
+    while (true) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        parked_.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // 登记后再检查一次，与完成线程的先写入后检查parked_配对，避免丢失唤醒
+        if (PopRecv(buffer)) {
+            parked_.fetch_sub(1);
+            return true;
+        }
+        auto wait = std::chrono::microseconds(1000000);
+        if (timeout_us > 0) {
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            wait = std::min(wait, timeout - elapsed);
+        }
+        if (!IsActive() || wait.count() <= 0) {
+            parked_.fetch_sub(1);
+            return false;
+        }
+        cv_.wait_for(lock, wait);
+        parked_.fetch_sub(1);
+    }
+}
+
+void RDMAProxy::ReleaseRecv(RecvBuffer* buffer) {
+    if (buffer->desc == nullptr && buffer->data >= ring_ && buffer->data < ring_ + ring_size_) {
+        ReleaseRingRecord(buffer->data);
+    } else if (buffer->desc == nullptr) {
+        if (buffer->data != nullptr) {
+            context_->recv_mr_manager->ReleaseBuffer(const_cast<char*>(buffer->data));
+        }
+    } else if (!closing && PostRecv(buffer->desc) == 0) {
+        credits_to_return_.fetch_add(1);
+        ReturnCredits();
+    }
+    *buffer = RecvBuffer();
+}
 
 void RDMAProxy::HandleWorkComplete(ibv_wc* wc) {
-    in_flight_tasks_.fetch_sub(1);
+    WRKind kind = WrKindOf(wc->wr_id);
+    if (kind == WRKind::Drain) {
+        drain_markers_.fetch_sub(1);
+        return;
+    }
+    SendDesc* desc = kind == WRKind::Send ? context_->send_wr_pool->Get(wc->wr_id) : nullptr;
+    // 未请求通知的WR只在出错被冲刷时产生完成事件，不计入in_flight_tasks_
+    if (desc == nullptr || (desc->wr.send_flags & IBV_SEND_SIGNALED)) {
+        in_flight_tasks_.fetch_sub(1);
+    }
+    if (kind == WRKind::Recv) {
+        recvs_posted_.fetch_sub(1, std::memory_order_relaxed);
+    }
     if (wc->status != IBV_WC_SUCCESS) {
-        if (!closing) Log(context_->logger.get(), "HandleWorkComplete WorkRequest(%d) Fail(status:%d, opcode:%d)", wc->wr_id, wc->status, wc->opcode);
+        if (!closing) Log(context_->logger.get(), "HandleWorkComplete WorkRequest(%lx) Fail(status:%d, opcode:%d)", wc->wr_id, wc->status, wc->opcode);
+        // 失败时opcode无效，依据wr_id回收发送资源
+        if (desc != nullptr) {
+            if (desc->wr.opcode == IBV_WR_RDMA_READ && !desc->one_sided) {
+                context_->recv_mr_manager->ReleaseBuffer((char*)desc->sge.addr);
+            }
+            ReclaimSends(desc, wc->status);
+        }
         return;
     }
-    if (wc->opcode & IBV_WC_RECV) {
-        std::unique_lock<std::mutex> lock(mtx_);
-        recv_msg_queue_.emplace(recv_buffers_[wc->wr_id].buffer, recv_buffers_[wc->wr_id].sz);
-        Log(context_->logger.get(), "RECV Msg(%d), addr:%ld : %s",wc->wr_id, recv_buffers_[wc->wr_id].buffer, recv_buffers_[wc->wr_id].buffer);
-        recv_buffers_.erase(wc->wr_id);
-        context_->recv_mr_manager->ReleaseMR(wc->wr_id);
-        if (!closing) PostRecv();
-        cv_.notify_one();
-    } else if (wc->opcode == IBV_WC_SEND) {
-        Log(context_->logger.get(), "SEND Msg(%d) SUCCESS", wc->wr_id);
-        context_->send_mr_manager->ReleaseMR(wc->wr_id);
+    if (kind == WRKind::Recv && wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+        HandleRingRecord(context_->recv_wr_pool->Get(wc->wr_id), ntohl(wc->imm_data), wc->byte_len);
+    } else if (kind == WRKind::Recv) {
+        HandleFrame(context_->recv_wr_pool->Get(wc->wr_id), wc->byte_len);
+    } else if (kind == WRKind::Send) {
+        if (desc->one_sided) {
+            LogDebug(context_->logger.get(), "%s(%d) SUCCESS, len:%u",
+                desc->wr.opcode == IBV_WR_RDMA_READ ? "READ" :
+                desc->wr.opcode == IBV_WR_RDMA_WRITE ? "WRITE" : "ATOMIC", WrIndexOf(wc->wr_id), desc->sge.length);
+        } else if (desc->wr.opcode == IBV_WR_RDMA_READ) {
+            // READ完成即得到完整的消息，通知对端释放缓冲区
+            LogDebug(context_->logger.get(), "READ Msg(%u) SUCCESS, len:%u", desc->msg_id, desc->sge.length);
+            RecvBuffer buffer;
+            buffer.data = (char*)desc->sge.addr;
+            buffer.len = desc->sge.length;
+            EnqueueRecv(buffer);
+            pending_done_.push_back(desc->msg_id);
+        } else {
+            LogDebug(context_->logger.get(), "SEND Msg(%d) SUCCESS", WrIndexOf(wc->wr_id));
+        }
+        ReclaimSends(desc, wc->status);
+        FlushDeferred();
     } else {
-        Log(context_->logger.get(), "Unknown opcode WC id : %d", wc->wr_id);
+        Log(context_->logger.get(), "Unknown opcode WC id : %lx", wc->wr_id);
+        return;
+    }
+}
+
+void RDMAProxy::HandleFrame(RecvDesc* desc, uint32_t byte_len) {
+    if (byte_len < sizeof(MsgHeader)) {
+        Log(context_->logger.get(), "RECV Msg(%d) Invalid frame, len:%u", WrIndexOf(desc->wr.wr_id), byte_len);
+        RepostRecv(desc);
+        return;
+    }
+    MsgHeader header;
+    memcpy(&header, desc->addr, sizeof(header));
+    if (header.credits > 0) {
+        send_credits_.fetch_add(header.credits);
+    }
+    char* payload = desc->addr + sizeof(MsgHeader);
+    uint32_t len = byte_len - sizeof(MsgHeader);
+    LogDebug(context_->logger.get(), "RECV Msg(%d), msg_id:%u, offset:%u, len:%u, total:%u, type:%d",
+        WrIndexOf(desc->wr.wr_id), header.msg_id, header.offset, len, header.total, (int)header.type);
+    if (header.type == FrameType::Data && header.offset == 0 && len == header.total) {
+        // 单个分片的消息直接借出接收缓冲区，在应用归还后才重新提交
+        RecvBuffer buffer;
+        buffer.data = payload;
+        buffer.len = len;
+        buffer.desc = desc;
+        EnqueueRecv(buffer);
         return;
     }
+    if (header.type == FrameType::Data) {
+        auto it = reassembly_.find(header.msg_id);
+        if (it == reassembly_.end()) {
+            Reassembly reassembly;
+            reassembly.addr = context_->recv_mr_manager->AllocateBuffer(header.total);
+            reassembly.received = 0;
+            if (reassembly.addr == nullptr) {
+                Log(context_->logger.get(), "RECV Msg(%u) AllocateBuffer(%u) Fail, drop", header.msg_id, header.total);
+            }
+            it = reassembly_.emplace(header.msg_id, reassembly).first;
+        }
+        if (it->second.addr != nullptr && header.offset + len <= header.total) {
+            memcpy(it->second.addr + header.offset, payload, len);
+        }
+        it->second.received += len;
+        RepostRecv(desc);
+        if (it->second.received >= header.total) {
+            if (it->second.addr != nullptr) {
+                RecvBuffer buffer;
+                buffer.data = it->second.addr;
+                buffer.len = header.total;
+                EnqueueRecv(buffer);
+            }
+            reassembly_.erase(it);
+        }
+    } else if (header.type == FrameType::Abort) {
+        RepostRecv(desc);
+        auto it = reassembly_.find(header.msg_id);
+        if (it != reassembly_.end()) {
+            Log(context_->logger.get(), "RECV Msg(%u) aborted by peer, received %u", header.msg_id, it->second.received);
+            if (it->second.addr != nullptr) {
+                context_->recv_mr_manager->ReleaseBuffer(it->second.addr);
+            }
+            reassembly_.erase(it);
+        }
+    } else if (header.type == FrameType::RendezvousRequest && len < sizeof(RendezvousInfo)) {
+        // 无法得知源缓冲区位置，丢弃该消息但仍通知对端释放缓冲区
+        Log(context_->logger.get(), "RECV Msg(%u) Invalid rendezvous frame, len:%u", header.msg_id, len);
+        RepostRecv(desc);
+        pending_done_.push_back(header.msg_id);
+        FlushDeferred();
+    } else if (header.type == FrameType::RendezvousRequest) {
+        PendingRead read;
+        read.msg_id = header.msg_id;
+        memcpy(&read.info, payload, sizeof(read.info));
+        RepostRecv(desc);
+        read.dest = context_->recv_mr_manager->AllocateBuffer(read.info.len);
+        if (read.dest == nullptr) {
+            // 无法接收时仍通知对端释放缓冲区
+            Log(context_->logger.get(), "RECV Msg(%u) AllocateBuffer(%u) Fail, drop", read.msg_id, read.info.len);
+            pending_done_.push_back(read.msg_id);
+        } else {
+            pending_reads_.push_back(read);
+        }
+        FlushDeferred();
+    } else if (header.type == FrameType::RendezvousDone) {
+        RepostRecv(desc);
+        std::unique_lock<std::mutex> lock(rendezvous_mtx_);
+        auto it = rendezvous_.find(header.msg_id);
+        if (it == rendezvous_.end()) {
+            Log(context_->logger.get(), "RendezvousDone unknown msg_id %u", header.msg_id);
+            return;
+        }
+        context_->send_mr_manager->ReleaseBuffer(it->second.frame);
+        if (it->second.cb) send_done_.emplace_back(std::move(it->second.cb), IBV_WC_SUCCESS);
+        rendezvous_.erase(it);
+    } else if (header.type == FrameType::Credit) {
+        RepostRecv(desc);
+    } else if (header.type == FrameType::Region && len < sizeof(RegionInfo)) {
+        Log(context_->logger.get(), "RECV Msg(%u) Invalid region frame, len:%u", header.msg_id, len);
+        RepostRecv(desc);
+    } else if (header.type == FrameType::Region) {
+        RegionInfo info;
+        memcpy(&info, payload, sizeof(info));
+        RepostRecv(desc);
+        Log(context_->logger.get(), "Peer Region(%u) addr:%lx, len:%lu", info.id, info.region.addr, info.region.len);
+        {
+            std::unique_lock<std::mutex> lock(region_mtx_);
+            remote_regions_[info.id] = info.region;
+        }
+        region_cv_.notify_all();
+    } else {
+        Log(context_->logger.get(), "RECV Msg(%u) Unknown frame type %d", header.msg_id, (int)header.type);
+        RepostRecv(desc);
+    }
 }
 
-int RDMAProxy::PostRecv() {
+void RDMAProxy::FinishBatch() {
+    if (!send_release_.empty()) {
+        context_->send_mr_manager->ReleaseBuffers(send_release_.data(), send_release_.size());
+        send_release_.clear();
+    }
+    for (auto& done : send_done_) {
+        done.first(done.second);
+    }
+    send_done_.clear();
+    // 本批次可能回收了描述符与发送缓冲区，或收到了credit与rendezvous的完成通知
+    NotifySend();
+    if (!recv_ready_.empty()) {
+        uint64_t now = latency_ ? MonotonicNs() : 0;
+        for (RecvBuffer& buffer : recv_ready_) {
+            buffer.queued_ns = now;
+            PushRecv(buffer);
+        }
+        // 仅在有接收方阻塞时加锁唤醒，空转中的接收方直接取走消息
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked_.load() > 0) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            if (recv_ready_.size() == 1) {
+                cv_.notify_one();
+            } else {
+                cv_.notify_all();
+            }
+        }
+        recv_ready_.clear();
+    }
+}
+
+void RDMAProxy::RecycleSendDesc(SendDesc* desc) {
+    if (desc->addr != nullptr &&
+        (desc->wr.opcode == IBV_WR_SEND || desc->wr.opcode == IBV_WR_RDMA_WRITE_WITH_IMM)) {
+        context_->send_mr_manager->ReleaseBuffer(desc->addr);
+    }
+    desc->addr = nullptr;
+    desc->wr.opcode = IBV_WR_SEND;
+    desc->wr.send_flags = IBV_SEND_SIGNALED;
+    desc->one_sided = false;
+    SendCallback& cb = send_callbacks_[WrIndexOf(desc->wr.wr_id)];
+    if (cb) cb = nullptr;
+    context_->send_wr_pool->Release(desc);
+}
+
+void RDMAProxy::FlushDeferred() {
+    ReturnCredits();
+    if (latency_ && context_->options.latency_dump_ms > 0) {
+        uint64_t now = MonotonicNs();
+        if (now - last_dump_ns_ >= context_->options.latency_dump_ms * 1000000ull) {
+            last_dump_ns_ = now;
+            DumpLatencyStats();
+        }
+    }
+    // 此前因描述符不足未能写回的接收环位置
+    if (ring_size_ > 0 && ring_head_.load() - ring_reported_.load() >= ring_size_ / 4) {
+        ReportRingHead();
+    }
+    while (!pending_done_.empty() && !closing) {
+        if (PostControl(FrameType::RendezvousDone, pending_done_.front(), nullptr, 0, false)) {
+            return;
+        }
+        pending_done_.pop_front();
+    }
+    while (!pending_reads_.empty() && !closing) {
+        SendDesc* desc = context_->send_wr_pool->Acquire();
+        if (desc == nullptr) {
+            return;
+        }
+        PendingRead& read = pending_reads_.front();
+        desc->msg_id = read.msg_id;
+        desc->wr.opcode = IBV_WR_RDMA_READ;
+        desc->wr.wr.rdma.remote_addr = read.info.addr;
+        desc->wr.wr.rdma.rkey = read.info.rkey;
+        desc->sge.addr = (uintptr_t)read.dest;
+        desc->sge.length = read.info.len;
+        desc->sge.lkey = context_->recv_mr_manager->LKey(read.dest);
+        if (PostSendChain(&desc, 1) != 1) {
+            Log(context_->logger.get(), "ibv_post_send READ msg(%u) Fail(%s)", read.msg_id, strerror(errno));
+            context_->recv_mr_manager->ReleaseBuffer(read.dest);
+            RecycleSendDesc(desc);
+        }
+        pending_reads_.pop_front();
+    }
+}
+
+int RDMAProxy::PostRecvChain(RecvDesc** descs, size_t n) {
+    if (n == 0) {
+        return 0;
+    }
+    for (size_t i = 0; i + 1 < n; i++) {
+        descs[i]->wr.next = &descs[i + 1]->wr;
+    }
     struct ibv_recv_wr* bad_wr = nullptr;
-    uint64_t wr_id = request_id_.fetch_add(1);
-    auto wr_wrapper = context_->recv_mr_manager->AllocateRecvWR(wr_id, 50);
-    if (wr_wrapper == nullptr) {
-        Log(context_->logger.get(), "PostRecv(%d): AllocateWR Fail", 50);
+    int ret = ibv_post_recv(context_->rdma_id->qp, &descs[0]->wr, &bad_wr);
+    for (size_t i = 0; i + 1 < n; i++) {
+        descs[i]->wr.next = nullptr;
+    }
+    if (ret) {
+        Log(context_->logger.get(), "ibv_post_recv %lu WRs Fail (%s)", n, strerror(errno));
+        post_failures_.fetch_add(1, std::memory_order_relaxed);
         return -1;
     }
-    recv_buffers_[wr_id] = RecvBuffer(wr_wrapper->addr, wr_wrapper->sz);
-    if(ibv_post_recv(context_->rdma_id->qp, wr_wrapper->wr, &bad_wr)) {
+    in_flight_tasks_.fetch_add(n);
+    recvs_posted_.fetch_add(n, std::memory_order_relaxed);
+    LogDebug(context_->logger.get(), "ibv_post_recv %lu WRs", n);
+    return 0;
+}
+
+void RDMAProxy::FlushRecv() {
+    if (recv_batch_.empty()) {
+        return;
+    }
+    if (!closing && PostRecvChain(recv_batch_.data(), recv_batch_.size()) == 0) {
+        credits_to_return_.fetch_add(recv_batch_.size());
+    }
+    recv_batch_.clear();
+}
+
+int RDMAProxy::PostRecv(RecvDesc* desc) {
+    struct ibv_recv_wr* bad_wr = nullptr;
+    if(ibv_post_recv(context_->rdma_id->qp, &desc->wr, &bad_wr)) {
         Log(context_->logger.get(), "ibv_post_recv Fail (%s)", strerror(errno));
+        post_failures_.fetch_add(1, std::memory_order_relaxed);
         return -1;
     }
     in_flight_tasks_.fetch_add(1);
-    Log(context_->logger.get(), "ibv_post_recv (%d)", wr_id);
+    recvs_posted_.fetch_add(1, std::memory_order_relaxed);
+    LogDebug(context_->logger.get(), "ibv_post_recv (%d)", WrIndexOf(desc->wr.wr_id));
     return 0;
 }
 void RDMAProxy::PollCQ() {
-    struct ibv_wc wc;
+    CompletionMode mode = context_->options.completion_mode;
+    auto spin = std::chrono::microseconds(context_->options.spin_us);
+    auto idle_start = std::chrono::steady_clock::now();
     while (in_flight_tasks_.load() > 0 || !closing) {
-        while(ibv_poll_cq(context_->send_complete_queue, 1, &wc)) {
-            HandleWorkComplete(&wc);
+        int n = DrainCQ();
+        FlushRecv();
+        FlushDeferred();
+        if (n > 0 || mode == CompletionMode::BusyPoll) {
+            if (n > 0) idle_start = std::chrono::steady_clock::now();
+            continue;
         }
-        while(ibv_poll_cq(context_->recv_complete_queue, 1, &wc)) {
-            HandleWorkComplete(&wc);
+        if (mode == CompletionMode::Hybrid && std::chrono::steady_clock::now() - idle_start < spin) {
+            continue;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(3));
+        WaitCompletionEvent();
+        idle_start = std::chrono::steady_clock::now();
     }
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    poll_cpu_ns_ = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    poll_wall_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - poll_start_).count();
     Log(context_->logger.get(), "PollCQ() Exit");
 }
 
+int RDMAProxy::DrainCQ() {
+    int batch = wc_.size();
+    int total = 0;
+    polls_.fetch_add(1, std::memory_order_relaxed);
+    // 交替轮询两个CQ，避免发送完成事件过多时饿死接收
+    while (total < (int)context_->options.poll_budget) {
+        int ns = ibv_poll_cq(context_->send_complete_queue, batch, wc_.data());
+        for (int i = 0; i < ns; i++) {
+            HandleWorkComplete(&wc_[i]);
+        }
+        int nr = ibv_poll_cq(context_->recv_complete_queue, batch, wc_.data());
+        for (int i = 0; i < nr; i++) {
+            HandleWorkComplete(&wc_[i]);
+        }
+        if (ns < 0 || nr < 0) {
+            Log(context_->logger.get(), "ibv_poll_cq Fail");
+            break;
+        }
+        total += ns + nr;
+        if (ns < batch && nr < batch) {
+            break;
+        }
+    }
+    FinishBatch();
+    if (total == 0) {
+        empty_polls_.fetch_add(1, std::memory_order_relaxed);
+    }
+    completions_.fetch_add(total, std::memory_order_relaxed);
+    return total;
+}
+
+void RDMAProxy::WaitCompletionEvent() {
+    ibv_comp_channel* channel = context_->comp_channel;
+    if (ibv_req_notify_cq(context_->send_complete_queue, 0) || ibv_req_notify_cq(context_->recv_complete_queue, 0)) {
+        Log(context_->logger.get(), "ibv_req_notify_cq Fail(%s)", strerror(errno));
+        return;
+    }
+    // 使能通知前到达的完成事件不会触发通知，需再轮询一次
+    if (DrainCQ() > 0) {
+        return;
+    }
+    sleeps_.fetch_add(1, std::memory_order_relaxed);
+    // 以超时等待，使连接关闭且无完成事件时也能退出
+    pollfd pfd;
+    pfd.fd = channel->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 100) <= 0) {
+        return;
+    }
+    ibv_cq* cq = nullptr;
+    void* cq_context = nullptr;
+    if (ibv_get_cq_event(channel, &cq, &cq_context)) {
+        Log(context_->logger.get(), "ibv_get_cq_event Fail(%s)", strerror(errno));
+        return;
+    }
+    ibv_ack_cq_events(cq, 1);
+    wakeups_.fetch_add(1, std::memory_order_relaxed);
+}
+
+CompletionStats RDMAProxy::GetCompletionStats() {
+    CompletionStats stats;
+    stats.mode = context_->options.completion_mode;
+    stats.polls = polls_.load(std::memory_order_relaxed);
+    stats.empty_polls = empty_polls_.load(std::memory_order_relaxed);
+    stats.completions = completions_.load(std::memory_order_relaxed);
+    stats.sleeps = sleeps_.load(std::memory_order_relaxed);
+    stats.wakeups = wakeups_.load(std::memory_order_relaxed);
+    stats.cpu_ns = poll_cpu_ns_.load();
+    stats.wall_ns = poll_wall_ns_.load();
+    if (stats.wall_ns == 0 && poll_cq_thread.joinable()) {
+        // 完成线程仍在运行时读取其CPU时钟
+        clockid_t clock;
+        timespec ts;
+        if (pthread_getcpuclockid(poll_cq_thread.native_handle(), &clock) == 0 && clock_gettime(clock, &ts) == 0) {
+            stats.cpu_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+        stats.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - poll_start_).count();
+    }
+    return stats;
+}
+
+ProxyStats RDMAProxy::GetStats() {
+    ProxyStats stats;
+    stats.msgs_sent = msgs_sent_.load(std::memory_order_relaxed);
+    stats.bytes_sent = bytes_sent_.load(std::memory_order_relaxed);
+    stats.msgs_received = msgs_received_.load(std::memory_order_relaxed);
+    stats.bytes_received = bytes_received_.load(std::memory_order_relaxed);
+    stats.post_failures = post_failures_.load(std::memory_order_relaxed);
+    stats.send_desc_stalls = send_desc_stalls_.load(std::memory_order_relaxed);
+    stats.send_buffer_stalls = send_buffer_stalls_.load(std::memory_order_relaxed);
+    stats.credit_stalls = credit_stalls_.load(std::memory_order_relaxed);
+    // 先读head，保证tail不小于head
+    size_t head = send_head_.load(std::memory_order_acquire);
+    stats.sends_in_flight = send_tail_.load(std::memory_order_acquire) - head;
+    stats.recvs_posted = recvs_posted_.load(std::memory_order_relaxed);
+    stats.recv_queue_depth = recv_msg_queue_.Size();
+    if (overflowed_.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> lock(overflow_mtx_);
+        stats.recv_queue_depth += recv_overflow_.size();
+    }
+    stats.send_credits = send_credits_.load(std::memory_order_relaxed);
+    stats.send_mr = context_->send_mr_manager->Stats();
+    stats.recv_mr = context_->recv_mr_manager->Stats();
+    stats.completion = GetCompletionStats();
+    return stats;
+}
+
+void RDMAProxy::DumpStats() {
+    ProxyStats s = GetStats();
+    FileLogger* logger = context_->logger.get();
+    Log(logger, "Stats sent:%lu msgs %lu bytes, received:%lu msgs %lu bytes, post failures:%lu",
+        s.msgs_sent, s.bytes_sent, s.msgs_received, s.bytes_received, s.post_failures);
+    Log(logger, "Stats stalls desc:%lu buffer:%lu credit:%lu, in flight:%lu, recvs posted:%lu, recv queue:%lu, credits:%d",
+        s.send_desc_stalls, s.send_buffer_stalls, s.credit_stalls, s.sends_in_flight, s.recvs_posted,
+        s.recv_queue_depth, s.send_credits);
+    Log(logger, "Stats send mr occupancy:%.3f largest free:%lu free blocks:%lu, recv mr occupancy:%.3f largest free:%lu free blocks:%lu",
+        s.send_mr.Occupancy(), s.send_mr.largest_free_block, s.send_mr.free_blocks,
+        s.recv_mr.Occupancy(), s.recv_mr.largest_free_block, s.recv_mr.free_blocks);
+    Log(logger, "Stats polls:%lu empty polls:%lu completions:%lu",
+        s.completion.polls, s.completion.empty_polls, s.completion.completions);
+}
+
+const char* LatencyKindName(LatencyKind kind) {
+    switch (kind) {
+        case LatencyKind::Send: return "send";
+        case LatencyKind::RingWrite: return "ring_write";
+        case LatencyKind::Write: return "write";
+        case LatencyKind::Read: return "read";
+        case LatencyKind::Atomic: return "atomic";
+        case LatencyKind::RecvToConsumer: return "recv_to_consumer";
+        case LatencyKind::RecvQueueWait: return "recv_queue_wait";
+        default: return "unknown";
+    }
+}
+
+LatencyStats RDMAProxy::GetLatencyStats() {
+    LatencyStats stats;
+    if (latency_) {
+        for (size_t i = 0; i < (size_t)LatencyKind::Count; i++) {
+            stats.kinds[i] = latency_[i].Snapshot();
+        }
+    }
+    return stats;
+}
+
+void RDMAProxy::ResetLatencyStats() {
+    if (latency_) {
+        for (size_t i = 0; i < (size_t)LatencyKind::Count; i++) {
+            latency_[i].Reset();
+        }
+    }
+}
+
+void RDMAProxy::DumpLatencyStats() {
+    LatencyStats stats = GetLatencyStats();
+    for (size_t i = 0; i < (size_t)LatencyKind::Count; i++) {
+        const LatencySnapshot& s = stats.kinds[i];
+        if (s.count == 0) continue;
+        Log(context_->logger.get(), "Latency %s count:%lu mean:%lu p50:%lu p99:%lu p999:%lu max:%lu ns",
+            LatencyKindName((LatencyKind)i), s.count, s.mean, s.p50, s.p99, s.p999, s.max);
+    }
+}
+
+void RDMAProxy::FillConnParam(const rdma_conn_param* request, rdma_conn_param* param) {
+    memset(param, 0, sizeof(*param));
+    // RDMA READ需要协商可同时进行的READ数量
+    ibv_device_attr attr;
+    uint8_t responder_resources = 1;
+    uint8_t initiator_depth = 1;
+    if (ibv_query_device(context_->rdma_id->verbs, &attr) == 0) {
+        responder_resources = std::min(attr.max_qp_rd_atom, 255);
+        initiator_depth = std::min(attr.max_qp_init_rd_atom, 255);
+    }
+    if (request != nullptr) {
+        responder_resources = std::min(responder_resources, request->initiator_depth);
+        initiator_depth = std::min(initiator_depth, request->responder_resources);
+    }
+    param->responder_resources = responder_resources;
+    param->initiator_depth = initiator_depth;
+    // 对端暂无接收请求时无限重试，而非断开连接
+    param->rnr_retry_count = 7;
+    param->private_data = &local_info_;
+    param->private_data_len = sizeof(local_info_);
+}
+
+void RDMAProxy::SetPeerInfo(const void* private_data, uint8_t len) {
+    ConnInfo info;
+    memset(&info, 0, sizeof(info));
+    if (private_data != nullptr) {
+        memcpy(&info, private_data, std::min<size_t>(len, sizeof(info)));
+    }
+    if (info.recv_slot_size > sizeof(MsgHeader)) {
+        peer_slot_size_ = info.recv_slot_size;
+    }
+    if (info.recv_depth > 0) {
+        send_credits_ = info.recv_depth;
+    }
+    if (info.ring_size > 0 && info.ring_addr != 0 && info.head_addr != 0 && ring_head_in_ != nullptr) {
+        peer_ring_addr_ = info.ring_addr;
+        peer_ring_size_ = info.ring_size;
+        peer_ring_rkey_ = info.ring_rkey;
+    }
+    peer_head_addr_ = info.head_addr;
+    peer_head_rkey_ = info.head_rkey;
+    Log(context_->logger.get(), "Peer recv_slot_size %u, recv_depth %u, ring_size %u",
+        peer_slot_size_, info.recv_depth, peer_ring_size_);
+}
+
 int RDMAProxy::Detach(bool keep_ec) {
+    if (context_->options.reactor) {
+        rdma_event_channel* ec = context_->rdma_id->channel;
+        if (context_->options.reactor->Watch(this)) {
+            return -1;
+        }
+        context_->shared_ec = true;
+        if (keep_ec) {
+            rdma_destroy_event_channel(ec);
+        }
+        Log(context_->logger.get(), "RDMAProxy Detach to reactor");
+        return 0;
+    }
     if (keep_ec) {
         context_->ec = context_->rdma_id->channel;
     } else {
@@ -177,18 +1724,263 @@ int RDMAProxy::Detach(bool keep_ec) {
             return -1;
         }
     }
-    
+    // 此后rdma_id的event channel归本连接所有
+    context_->shared_ec = false;
     wait_disconnected_thread = std::thread(&RDMAProxy::WaitDisconnected, this);
     Log(context_->logger.get(), "RDMAProxy Detach");
     return 0;
 }
 
+ibv_mr* RDMAProxy::RegisterMemory(void* addr, size_t len, int access) {
+    if (access & IBV_ACCESS_REMOTE_ATOMIC) {
+        ibv_device_attr attr;
+        if (ibv_query_device(context_->rdma_id->verbs, &attr) || attr.atomic_cap == IBV_ATOMIC_NONE) {
+            Log(context_->logger.get(), "RegisterMemory: device has no atomic support, REMOTE_ATOMIC dropped");
+            access &= ~IBV_ACCESS_REMOTE_ATOMIC;
+        }
+    }
+    ibv_mr* mr = ibv_reg_mr(context_->rdma_id->pd, addr, len, access);
+    if (mr == nullptr) {
+        Log(context_->logger.get(), "RegisterMemory(%lu) Fail(%s)", len, strerror(errno));
+        return nullptr;
+    }
+    std::unique_lock<std::mutex> lock(region_mtx_);
+    local_mrs_.push_back(mr);
+    return mr;
+}
+
+int RDMAProxy::DeregisterMemory(ibv_mr* mr) {
+    {
+        std::unique_lock<std::mutex> lock(region_mtx_);
+        auto it = std::find(local_mrs_.begin(), local_mrs_.end(), mr);
+        if (it == local_mrs_.end()) {
+            Log(context_->logger.get(), "DeregisterMemory: unknown mr");
+            return -1;
+        }
+        local_mrs_.erase(it);
+    }
+    if (ibv_dereg_mr(mr)) {
+        Log(context_->logger.get(), "DeregisterMemory Fail(%s)", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int RDMAProxy::ExposeRegion(uint32_t id, ibv_mr* mr, size_t offset, size_t len) {
+    if (offset + len > mr->length) {
+        Log(context_->logger.get(), "ExposeRegion(%u): [%lu, %lu) out of mr (%lu)", id, offset, offset + len, mr->length);
+        return -1;
+    }
+    RegionInfo info;
+    info.id = id;
+    info.region.addr = (uintptr_t)mr->addr + offset;
+    info.region.len = len;
+    info.region.rkey = mr->rkey;
+    return PostControl(FrameType::Region, 0, &info, sizeof(info), true);
+}
+
+int RDMAProxy::GetRemoteRegion(uint32_t id, RemoteRegion* region) {
+    std::unique_lock<std::mutex> lock(region_mtx_);
+    auto it = remote_regions_.find(id);
+    if (it == remote_regions_.end()) {
+        return -1;
+    }
+    *region = it->second;
+    return 0;
+}
+
+int RDMAProxy::WaitRemoteRegion(uint32_t id, RemoteRegion* region) {
+    std::unique_lock<std::mutex> lock(region_mtx_);
+    auto it = remote_regions_.find(id);
+    while (it == remote_regions_.end()) {
+        if (!IsActive()) {
+            Log(context_->logger.get(), "WaitRemoteRegion(%u): Proxy Closing", id);
+            return -1;
+        }
+        region_cv_.wait_for(lock, std::chrono::milliseconds(100));
+        it = remote_regions_.find(id);
+    }
+    *region = it->second;
+    return 0;
+}
+
+int RDMAProxy::Write(ibv_mr* mr, size_t offset, uint32_t len, const RemoteRegion& remote, uint64_t remote_offset,
+                     SendCallback cb) {
+    return PostOneSided(IBV_WR_RDMA_WRITE, mr, offset, len, remote, remote_offset, std::move(cb));
+}
+
+int RDMAProxy::Read(ibv_mr* mr, size_t offset, uint32_t len, const RemoteRegion& remote, uint64_t remote_offset,
+                    SendCallback cb) {
+    return PostOneSided(IBV_WR_RDMA_READ, mr, offset, len, remote, remote_offset, std::move(cb));
+}
+
+int RDMAProxy::PostOneSided(ibv_wr_opcode opcode, ibv_mr* mr, size_t offset, uint32_t len,
+                            const RemoteRegion& remote, uint64_t remote_offset, SendCallback cb) {
+    if (offset + len > mr->length || remote_offset + len > remote.len) {
+        Log(context_->logger.get(), "PostOneSided(%d): len %u out of range", (int)opcode, len);
+        return -1;
+    }
+    // 单边操作不消耗对端的接收请求，无需credit
+    SendDesc* desc = AcquireSendDesc(context_->options.blocking_send);
+    if (desc == nullptr) {
+        Log(context_->logger.get(), "PostOneSided(%d): Send queue full", (int)opcode);
+        return -1;
+    }
+    desc->one_sided = true;
+    desc->wr.opcode = opcode;
+    desc->wr.wr.rdma.remote_addr = remote.addr + remote_offset;
+    desc->wr.wr.rdma.rkey = remote.rkey;
+    desc->sge.addr = (uintptr_t)mr->addr + offset;
+    desc->sge.length = len;
+    desc->sge.lkey = mr->lkey;
+    if (cb) SetSendCallback(desc, std::move(cb));
+    if (PostSendChain(&desc, 1) != 1) {
+        RecycleSendDesc(desc);
+        return -1;
+    }
+    return 0;
+}
+
+int RDMAProxy::FetchAdd(const RemoteRegion& remote, uint64_t remote_offset, uint64_t add, AtomicCallback cb) {
+    return PostAtomic(IBV_WR_ATOMIC_FETCH_AND_ADD, remote, remote_offset, add, 0, std::move(cb));
+}
+
+int RDMAProxy::CompareSwap(const RemoteRegion& remote, uint64_t remote_offset, uint64_t compare, uint64_t swap,
+                           AtomicCallback cb) {
+    return PostAtomic(IBV_WR_ATOMIC_CMP_AND_SWP, remote, remote_offset, compare, swap, std::move(cb));
+}
+
+int RDMAProxy::PostAtomic(ibv_wr_opcode opcode, const RemoteRegion& remote, uint64_t remote_offset,
+                          uint64_t compare_add, uint64_t swap, AtomicCallback cb) {
+    uint64_t addr = remote.addr + remote_offset;
+    if (remote_offset + sizeof(uint64_t) > remote.len || addr % sizeof(uint64_t) != 0) {
+        Log(context_->logger.get(), "PostAtomic(%d): remote offset %lu invalid", (int)opcode, remote_offset);
+        return -1;
+    }
+    // 结果槽位于接收内存区域，由设备写入目标地址在操作前的值
+    MRManager* recv_mr = context_->recv_mr_manager.get();
+    char* slot = recv_mr->AllocateBuffer(sizeof(uint64_t));
+    if (slot == nullptr) {
+        Log(context_->logger.get(), "PostAtomic(%d): AllocateBuffer Fail", (int)opcode);
+        return -1;
+    }
+    SendDesc* desc = AcquireSendDesc(context_->options.blocking_send);
+    if (desc == nullptr) {
+        Log(context_->logger.get(), "PostAtomic(%d): Send queue full", (int)opcode);
+        recv_mr->ReleaseBuffer(slot);
+        return -1;
+    }
+    desc->one_sided = true;
+    desc->wr.opcode = opcode;
+    desc->wr.wr.atomic.remote_addr = addr;
+    desc->wr.wr.atomic.compare_add = compare_add;
+    desc->wr.wr.atomic.swap = swap;
+    desc->wr.wr.atomic.rkey = remote.rkey;
+    desc->sge.addr = (uintptr_t)slot;
+    desc->sge.length = sizeof(uint64_t);
+    desc->sge.lkey = recv_mr->LKey(slot);
+    SetSendCallback(desc, [recv_mr, slot, cb](ibv_wc_status status) {
+        uint64_t value = *(volatile uint64_t*)slot;
+        recv_mr->ReleaseBuffer(slot);
+        if (cb) cb(status, value);
+    });
+    if (PostSendChain(&desc, 1) != 1) {
+        RecycleSendDesc(desc);
+        recv_mr->ReleaseBuffer(slot);
+        return -1;
+    }
+    return 0;
+}
+
+bool RDMAProxy::SendPending() {
+    if (send_head_.load() != send_tail_.load()) {
+        return true;
+    }
+    std::unique_lock<std::mutex> lock(rendezvous_mtx_);
+    return !rendezvous_.empty();
+}
+
+int RDMAProxy::Flush() {
+    uint32_t last_msg_id = next_msg_id_.load();
+    // 末尾未请求通知的WR须由一个请求通知的WR带出完成事件，由Credit帧承担
+    bool carrier;
+    {
+        std::unique_lock<std::mutex> lock(send_mtx_);
+        carrier = unsignaled_ > 0;
+        if (carrier) unsignaled_ = std::max<uint32_t>(context_->options.signal_interval, 1) - 1;
+    }
+    if (carrier && PostControl(FrameType::Credit, 0, nullptr, 0, true)) {
+        Log(context_->logger.get(), "Flush: post carrier Fail");
+        return -1;
+    }
+    size_t target = send_tail_.load();
+    bool done = WaitSend([&] {
+        if (send_head_.load() < target) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(rendezvous_mtx_);
+        for (auto& it : rendezvous_) {
+            if (it.first < last_msg_id) {
+                return false;
+            }
+        }
+        return true;
+    });
+    if (!done) {
+        Log(context_->logger.get(), "Flush: Proxy Closing");
+        return -1;
+    }
+    return 0;
+}
+
 int RDMAProxy::Disconnect() {
     Log(context_->logger.get(), "Disconnect");
     closing = true;
     return rdma_disconnect(context_->rdma_id);
 }
 
+void RDMAProxy::DrainQP() {
+    ibv_qp* qp = context_->rdma_id->qp;
+    ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_ERR;
+    if (ibv_modify_qp(qp, &attr, IBV_QP_STATE)) {
+        Log(context_->logger.get(), "DrainQP ibv_modify_qp Fail(%s)", strerror(errno));
+        return;
+    }
+    ibv_send_wr send_wr;
+    memset(&send_wr, 0, sizeof(send_wr));
+    send_wr.wr_id = MakeWrId(WRKind::Drain, 0);
+    send_wr.opcode = IBV_WR_SEND;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    ibv_recv_wr recv_wr;
+    memset(&recv_wr, 0, sizeof(recv_wr));
+    recv_wr.wr_id = MakeWrId(WRKind::Drain, 1);
+    drain_markers_ = 2;
+    // 队列已满时须等待reactor取回冲刷事件腾出空间
+    ibv_send_wr* bad_send = nullptr;
+    while (ibv_post_send(qp, &send_wr, &bad_send)) {
+        if (in_flight_tasks_.load() == 0 && send_head_.load() == send_tail_.load()) {
+            Log(context_->logger.get(), "DrainQP ibv_post_send Fail(%s)", strerror(errno));
+            drain_markers_.fetch_sub(1);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ibv_recv_wr* bad_recv = nullptr;
+    while (ibv_post_recv(qp, &recv_wr, &bad_recv)) {
+        if (in_flight_tasks_.load() == 0) {
+            Log(context_->logger.get(), "DrainQP ibv_post_recv Fail(%s)", strerror(errno));
+            drain_markers_.fetch_sub(1);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    while (drain_markers_.load() > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
 void RDMAProxy::WaitDisconnected() {
     struct rdma_cm_event *event = nullptr;
     if (rdma_get_cm_event(context_->ec, &event)) {
@@ -5,60 +5,234 @@
 
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include <unordered_map>
 #include <mutex>
 #include <condition_variable>
-#include <queue>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <future>
 
 #include "logger.h"
 #include "mr_manager.h"
+#include "bounded_queue.h"
+#include "latency_histogram.h"
 
 namespace RDMA_ECHO {
 
 #define TEST(x)  do { if (!(x)) { fprintf(stderr, "error: %s failed.\n", #x); exit(1); }} while (0)
 
-constexpr int RDMABUFFERSIZE = 4096;
+constexpr int RECVBUFFERSIZE = 4096;  // 每个接收缓冲区槽的默认大小
+constexpr uint32_t MAXINLINEDATA = 1024;  // 内联发送的上限，内联帧在栈上构造
+constexpr uint32_t MINCREDITTHRESHOLD = 2;  // Credit帧本身也消耗一个接收请求，阈值为1时双方将无休止地互发Credit帧
+constexpr uint32_t MINRECVDEPTH = 3;        // 对端保留一个credit给Credit帧，且本端至多欠下阈值减一个credit时仍可发送数据
+constexpr uint32_t SENDSPINCOUNT = 256;     // 发送资源不足时阻塞前的空转次数
+constexpr uint32_t SENDWAITUS = 1000;       // 发送方单次阻塞的上限，此后重新检查
 
 class RDMAClient;
 class RDMAServer;
+class RDMAReactor;
+
+// 完成事件的处理方式
+enum class CompletionMode {
+    BusyPoll,  // 持续轮询CQ，延迟最低但独占一个核
+    Event,     // 通过completion channel阻塞等待，空闲时不占用CPU
+    Hybrid,    // 空轮询超过spin_us后转为阻塞等待
+};
+
+// RDMAProxy的可配置项
+struct RDMAProxyOptions {
+    size_t arena_chunk_size{2 << 20};  // 发送/接收内存区域每次增长注册的字节数
+    size_t arena_max_chunks{16};       // 发送内存区域最多包含的chunk数量
+    bool use_hugepage{true};           // 内存区域优先使用2MiB大页
+    uint32_t recv_slot_size{RECVBUFFERSIZE};  // 接收缓冲区槽的大小，决定对端单个分片的最大长度
+    uint32_t rendezvous_threshold{64 << 10};  // 超过该长度的消息不再分片，由对端通过RDMA READ拉取
+    uint32_t signal_interval{1};              // 每隔多少个SEND请求一次完成通知，批量提交的最后一个WR总是请求通知
+    CompletionMode completion_mode{CompletionMode::Hybrid};
+    uint32_t spin_us{50};                     // Hybrid模式下转为阻塞前的空轮询时间
+    uint32_t poll_batch{16};                  // 每次ibv_poll_cq最多取回的完成事件数量
+    uint32_t poll_budget{256};                // 每轮最多处理的完成事件数量，用尽后先重新提交接收请求
+    uint32_t recv_queue_size{4096};           // 无锁接受队列的容量，溢出的消息暂存于加锁的后备队列
+    uint32_t recv_spin_us{20};                // 接受队列为空时，接收方阻塞前的空转时间
+    uint32_t max_inline_data{256};            // 向设备请求的内联上限，不超过该长度的帧随WR拷贝而不占用发送缓冲区
+    bool blocking_send{true};                 // 发送描述符、发送缓冲区或credit不足时SendMessage与ReserveSend阻塞等待而非返回-1；
+                                              // 多分片的消息在首个分片提交后总是等待其余分片的资源
+    bool latency_stats{false};                // 记录各操作的延迟直方图，开启后每个WR与每条消息读取一至两次时钟
+    uint32_t latency_dump_ms{0};              // 非0时完成线程每隔该时间将延迟直方图写入日志
+    uint32_t send_wr_depth{30};               // QP发送队列与发送CQ的深度，即Send描述符的数量
+    uint32_t recv_wr_depth{30};               // QP接收队列与接收CQ的深度，即预先提交的接收请求数量与对端的初始credit，不小于MINRECVDEPTH
+    bool async_log{false};                    // RDMAClient/RDMAServer的日志由后台线程批量写入
+    bool log_terminal{true};                  // RDMAClient/RDMAServer的日志同时输出至标准输出
+    uint32_t ring_size{0};                    // 非0时分配该大小的接收环，对端将不超过其1/4的消息以RDMA WRITE_WITH_IMM直接写入
+    // 非空时不再为每个连接创建CQ与线程，完成事件与断开事件均由reactor的共享线程处理，
+    // 此时completion_mode与spin_us以reactor的配置为准
+    std::shared_ptr<RDMAReactor> reactor;
+};
+
+// 完成线程的运行统计，用于比较不同CompletionMode的开销
+struct CompletionStats {
+    CompletionMode mode;
+    uint64_t polls{0};        // ibv_poll_cq调用次数
+    uint64_t empty_polls{0};  // 未取得任何完成事件的轮询次数
+    uint64_t completions{0};  // 处理的完成事件数量
+    uint64_t sleeps{0};       // 阻塞等待completion channel的次数
+    uint64_t wakeups{0};      // 由completion channel唤醒的次数
+    uint64_t cpu_ns{0};       // 完成线程消耗的CPU时间
+    uint64_t wall_ns{0};      // 完成线程运行的时间
+
+    // 完成线程的CPU占用率
+    inline double CpuUsage() const { return wall_ns == 0 ? 0 : (double)cpu_ns / wall_ns; }
+    // 每个完成事件平均消耗的CPU时间
+    inline double CpuPerCompletion() const { return completions == 0 ? 0 : (double)cpu_ns / completions; }
+};
+
+// GetStats的结果，用于确定缓冲区与队列深度，并在发送被丢弃前发现资源不足
+struct ProxyStats {
+    uint64_t msgs_sent{0};          // 成功提交的消息数量，不含单边操作
+    uint64_t bytes_sent{0};
+    uint64_t msgs_received{0};      // 完整接收并放入接受队列的消息数量
+    uint64_t bytes_received{0};
+    uint64_t post_failures{0};      // ibv_post_send与ibv_post_recv的失败次数
+    uint64_t send_desc_stalls{0};   // 获取Send描述符时池为空的次数
+    uint64_t send_buffer_stalls{0}; // 发送内存区域分配失败的次数
+    uint64_t credit_stalls{0};      // 获取credit时对端接收请求不足的次数
+    uint64_t sends_in_flight{0};    // 已提交但尚未回收的Send描述符数量，含未请求通知的WR
+    uint64_t recvs_posted{0};       // 已提交且尚未完成的接收请求数量
+    uint64_t recv_queue_depth{0};   // 接受队列中尚未被取走的消息数量，含后备队列
+    int32_t send_credits{0};        // 当前可用的credit
+    MRStats send_mr;                // 发送内存区域的占用、最大空闲块与空闲块数量
+    MRStats recv_mr;                // 接收内存区域，同上
+    CompletionStats completion;     // 含轮询次数与空轮询次数
+};
+
+// 延迟直方图的种类
+enum class LatencyKind {
+    Send,            // SEND提交至完成事件被处理，未请求通知的WR以其后请求通知的WR的完成为准
+    RingWrite,       // 写入对端接收环的WRITE_WITH_IMM，同上
+    Write,           // 单边WRITE，同上
+    Read,            // 单边READ与rendezvous的READ
+    Atomic,          // 远程原子操作
+    RecvToConsumer,  // 接收完成事件被处理至消息被应用取走
+    RecvQueueWait,   // 消息放入接受队列至被应用取走
+    Count,
+};
+
+const char* LatencyKindName(LatencyKind kind);
+
+// GetLatencyStats的结果，以LatencyKind索引
+struct LatencyStats {
+    LatencySnapshot kinds[(size_t)LatencyKind::Count];
+
+    inline const LatencySnapshot& Get(LatencyKind kind) const { return kinds[(size_t)kind]; }
+};
+
+// 帧类型
+enum class FrameType : uint16_t {
+    Data = 0,               // 完整的消息或其分片
+    RendezvousRequest = 1,  // 携带发送缓冲区的地址与rkey，由对端READ
+    RendezvousDone = 2,     // 对端READ完成，发送方可释放缓冲区
+    Credit = 3,             // 无负载，仅用于归还credit
+    Region = 4,             // 公开一段可由对端单边访问的内存区域
+    Abort = 5,              // 无负载，发送方放弃已部分发出的分片消息，对端丢弃其重组缓冲区
+};
+
+// 每个SEND负载的帧头
+struct MsgHeader {
+    uint32_t msg_id;  // 发送方分配的消息序号
+    uint32_t offset;  // 分片在消息中的偏移
+    uint32_t total;   // 消息总长度
+    FrameType type;
+    uint16_t credits; // 捎带归还的credit，即发送方自上次归还以来重新提交的接收请求数量
+};
+
+// RendezvousRequest的负载
+struct RendezvousInfo {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t len;
+};
+
+// 对端通过ExposeRegion公开的内存区域
+struct RemoteRegion {
+    uint64_t addr{0};
+    uint64_t len{0};
+    uint32_t rkey{0};
+};
+
+// Region帧的负载
+struct RegionInfo {
+    uint32_t id;
+    RemoteRegion region;
+};
+
+// 建立连接时通过rdma_conn_param::private_data交换的本端参数
+struct ConnInfo {
+    uint32_t recv_slot_size;
+    uint32_t recv_depth;  // 预先提交的接收请求数量，即对端的初始credit
+    uint64_t ring_addr;   // 接收环，ring_size为0时不使用
+    uint32_t ring_size;
+    uint32_t ring_rkey;
+    uint64_t head_addr;   // 对端以RDMA WRITE写入其已消费的接收环位置
+    uint32_t head_rkey;
+};
 
 struct RDMAProxyContext {
-    RDMAProxyContext(rdma_cm_id *id, std::shared_ptr<FileLogger> logger)
+    RDMAProxyContext(rdma_cm_id *id, std::shared_ptr<FileLogger> logger, const RDMAProxyOptions& options)
         : logger(logger),
+          options(options),
           rdma_id(id),
-          send_complete_queue(id->send_cq),
-          recv_complete_queue(id->recv_cq) {}
-    ~RDMAProxyContext() {
-        auto ec = rdma_id->channel;
-        rdma_destroy_qp(rdma_id);
-        if (send_mr_manager->DeregisterMR()) {
-            Log(logger.get(), "~RDMAProxyContext() send_mr_manager->DeregisterMR() Fail(%s)", strerror(errno));
-        }
-        if (recv_mr_manager->DeregisterMR()) {
-            Log(logger.get(), "~RDMAProxyContext() recv_mr_manager->DeregisterMR() Fail(%s)", strerror(errno));
-        }
-        if (ibv_dealloc_pd(rdma_id->pd)) {
-            Log(logger.get(), "~RDMAProxyContext() ibv_dealloc_pd Fail(%s)", strerror(errno));
-        }
-        if (rdma_destroy_id(rdma_id)) {
-            Log(logger.get(), "~RDMAProxyContext() rdma_destroy_id Fail(%s)", strerror(errno));
-        }
-        rdma_destroy_event_channel(ec);
-    }
+          max_recv_cqe(options.recv_wr_depth),
+          max_send_cqe(options.send_wr_depth) {}
+    ~RDMAProxyContext();
     std::shared_ptr<FileLogger> logger;
+    RDMAProxyOptions options;
     rdma_event_channel *ec;
     rdma_cm_id *rdma_id;
     std::unique_ptr<MRManager> send_mr_manager;
     std::unique_ptr<MRManager> recv_mr_manager;
-    ibv_cq* send_complete_queue;
-    ibv_cq* recv_complete_queue;
-    int max_recv_cqe{30};
-    int max_send_cqe{30};
+    std::unique_ptr<SendWRPool> send_wr_pool;  // 与发送队列深度一致的Send描述符池
+    std::unique_ptr<RecvWRPool> recv_wr_pool;  // 与接收队列深度一致的Recv描述符池
+    ibv_cq* send_complete_queue{nullptr};  // reactor模式下与recv_complete_queue为同一个共享CQ
+    ibv_cq* recv_complete_queue{nullptr};
+    ibv_comp_channel* comp_channel{nullptr};  // 两个CQ共用，BusyPoll模式下为nullptr
+    bool shared_ec{false};  // rdma_id的event channel不归本连接所有，如reactor的或Detach前服务端监听的
+    bool owns_id{false};    // GenerateProxy成功后才置位，此前析构不销毁rdma_id及其event channel
+    uint32_t max_inline{0};  // QP实际支持的内联上限
+    int max_recv_cqe;
+    int max_send_cqe;
 };
 
 class RDMAProxy;
 
-std::unique_ptr<RDMAProxy> GenerateProxy(rdma_cm_id *conn, std::shared_ptr<FileLogger> logger);
+// 发送内存区域中的一段可写缓冲区，由ReserveSend()分配，CommitSend()或AbortSend()归还
+struct SendBuffer {
+    char* data{nullptr};     // 可直接写入的已注册内存
+    uint32_t capacity{0};    // 可写入的字节数
+    SendDesc* desc{nullptr}; // 预留的Send描述符
+};
+
+// 借出给应用的接收缓冲区视图，由AcquireRecv()获得，ReleaseRecv()归还后才重新提交接收请求
+struct RecvBuffer {
+    const char* data{nullptr}; // 已注册的接收缓冲区
+    uint32_t len{0};           // 消息长度
+    RecvDesc* desc{nullptr};   // 为nullptr时data为重组或READ得到的独立缓冲区
+    uint64_t complete_ns{0};   // 开启latency_stats时，完成事件被处理的时刻
+    uint64_t queued_ns{0};     // 开启latency_stats时，放入接受队列的时刻
+};
+
+// 异步发送的完成回调，以消息最后一个WR的完成状态调用。
+// 回调在完成线程中执行，reactor模式下该线程为同一轮询线程上的所有连接服务，回调不应阻塞；
+// 析构须等待完成线程取回冲刷事件，回调中不可析构产生该回调的RDMAProxy，reactor模式下亦不可析构同一reactor上的其他RDMAProxy
+using SendCallback = std::function<void(ibv_wc_status)>;
+
+// 原子操作的完成回调，value为目标地址在操作前的值，仅当status为IBV_WC_SUCCESS时有效，执行限制同SendCallback
+using AtomicCallback = std::function<void(ibv_wc_status status, uint64_t value)>;
+
+// 在conn上创建RDMAProxy，成功后conn及其event channel归返回的RDMAProxy所有；
+// 失败时返回nullptr，已创建的资源均被释放，conn与其event channel仍由调用方销毁
+std::unique_ptr<RDMAProxy> GenerateProxy(rdma_cm_id *conn, std::shared_ptr<FileLogger> logger,
+                                         const RDMAProxyOptions& options = RDMAProxyOptions());
 
 int RegisterMemoryRegion(RDMAProxyContext* proxy_context, std::shared_ptr<FileLogger> logger);
 
@@ -70,28 +244,129 @@ class RDMAProxy {
     // 异步提交发送请求，提交失败返回-1
     int SendMessage(const std::string& msg);
 
-    // 从接受队列中获取一条消息，当队列为空时则阻塞地
+    // 与SendMessage相同地提交msg，消息的所有WR完成后（rendezvous消息为对端READ完成后）
+    // 在完成线程中以最终状态调用cb，cb不应阻塞；提交失败时返回-1且不调用cb，
+    // 连接关闭时尚未完成的消息以IBV_WC_WR_FLUSH_ERR回调
+    int SendMessageAsync(const std::string& msg, SendCallback cb);
+
+    // 以future返回SendMessageAsync的最终状态，提交失败时future即为IBV_WC_GENERAL_ERR
+    std::future<ibv_wc_status> SendMessageAsync(const std::string& msg);
+
+    // 在发送内存区域中预留sz字节，调用方可直接在buffer->data上序列化；
+    // 能以单个分片发送时同时占用一个Send描述符，失败时返回-1
+    int ReserveSend(uint32_t sz, SendBuffer* buffer);
+
+    // 将buffer的前len字节作为一条消息提交，提交失败返回-1且buffer被归还；
+    // 超过单个分片的消息被拆分发送，超过rendezvous_threshold的消息由对端READ，
+    // 缓冲区在SEND完成或对端READ完成后释放
+    int CommitSend(SendBuffer* buffer, uint32_t len);
+
+    // 与CommitSend相同，并在消息完成后以最终状态调用cb
+    int CommitSendAsync(SendBuffer* buffer, uint32_t len, SendCallback cb);
+
+    // 归还未提交的buffer
+    void AbortSend(SendBuffer* buffer);
+
+    // 依次提交n个buffer，相邻的单分片消息被串联为一条WR链并只触发一次ibv_post_send；
+    // 任意一条提交失败时返回-1，所有buffer均被提交或归还
+    int CommitSendBatch(SendBuffer* buffers, const uint32_t* lens, size_t n);
+
+    // 以CommitSendBatch批量发送msgs，预留失败时不发送任何消息并返回-1
+    int SendBatch(const std::vector<std::string>& msgs);
+
+    // 从接受队列中获取一条消息，当队列为空时则先空转recv_spin_us再阻塞地
     // 等待来自对端的请求，当连接关闭且队列为空时返回-1
     int RecvMessage(std::string& msg); 
 
+    // 非阻塞地获取一条消息，队列为空时返回-1
+    int TryRecv(std::string& msg);
+
+    // 与RecvMessage相同地空转后阻塞等待，但至多等待timeout_us，超时或连接关闭且队列为空时返回-1
+    int RecvMessageFor(std::string& msg, uint32_t timeout_us);
+
+    // 与RecvMessage相同地等待第一条消息，之后不再阻塞地取出至多max条，
+    // 返回追加至msgs的消息数量，当连接关闭且队列为空时返回-1
+    int RecvMany(std::vector<std::string>& msgs, size_t max);
+
+    // 与RecvMessage相同地等待消息，但不拷贝而是直接借出接收缓冲区，借出期间该缓冲区不会被重新提交，
+    // 所有buffer须在RDMAProxy析构前归还
+    int AcquireRecv(RecvBuffer* buffer);
+
+    // 归还借出的接收缓冲区并重新提交接收请求
+    void ReleaseRecv(RecvBuffer* buffer);
+
+    // 在本连接的protection domain中注册应用内存，失败时返回nullptr；
+    // 返回的MR在DeregisterMemory或RDMAProxy析构时注销；设备不支持原子操作时去除IBV_ACCESS_REMOTE_ATOMIC
+    ibv_mr* RegisterMemory(void* addr, size_t len,
+                           int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE |
+                                        IBV_ACCESS_REMOTE_ATOMIC);
+
+    // 注销RegisterMemory返回的MR，失败时返回-1
+    int DeregisterMemory(ibv_mr* mr);
+
+    // 以id向对端公开mr中[offset, offset + len)的区域，对端可通过WaitRemoteRegion获得，失败时返回-1
+    int ExposeRegion(uint32_t id, ibv_mr* mr, size_t offset, size_t len);
+
+    // 阻塞地等待对端以id公开的区域，连接关闭时返回-1
+    int WaitRemoteRegion(uint32_t id, RemoteRegion* region);
+
+    // 非阻塞地获取对端以id公开的区域，尚未收到时返回-1
+    int GetRemoteRegion(uint32_t id, RemoteRegion* region);
+
+    // 将mr中[offset, offset + len)的数据RDMA WRITE至remote的remote_offset处，不经过对端CPU；
+    // 完成后在完成线程中以最终状态调用cb，cb可为nullptr，提交失败或越界时返回-1
+    int Write(ibv_mr* mr, size_t offset, uint32_t len, const RemoteRegion& remote, uint64_t remote_offset,
+              SendCallback cb);
+
+    // 将remote的remote_offset处的数据RDMA READ至mr中[offset, offset + len)，其余同Write
+    int Read(ibv_mr* mr, size_t offset, uint32_t len, const RemoteRegion& remote, uint64_t remote_offset,
+             SendCallback cb);
+
+    // 对remote的remote_offset处8字节对齐的uint64_t原子地加上add，不经过对端CPU；
+    // 操作前的值由设备写入本地已注册的结果槽，完成后在完成线程中以cb返回，提交失败或地址无效时返回-1
+    int FetchAdd(const RemoteRegion& remote, uint64_t remote_offset, uint64_t add, AtomicCallback cb);
+
+    // 当remote的remote_offset处的值等于compare时原子地替换为swap，其余同FetchAdd，
+    // cb的value等于compare即表示替换成功
+    int CompareSwap(const RemoteRegion& remote, uint64_t remote_offset, uint64_t compare, uint64_t swap,
+                    AtomicCallback cb);
+
+    // 阻塞直至调用前提交的所有发送均已完成，且其中的rendezvous消息已被对端读取，
+    // 连接关闭时返回-1
+    int Flush();
+
     // 主动地关闭连接，失败时返回-1
     int Disconnect();
 
     inline bool IsActive() {
         return closing.load() == false;
     }
+
+    // 完成线程的运行统计
+    CompletionStats GetCompletionStats();
+
+    // 连接的运行计数、队列占用与内存区域统计的快照，各项分别读取，彼此间不保证一致
+    ProxyStats GetStats();
+
+    // 将GetStats的结果写入日志
+    void DumpStats();
+
+    // 各操作的延迟分布，未开启latency_stats时均为空
+    LatencyStats GetLatencyStats();
+
+    // 清空延迟直方图
+    void ResetLatencyStats();
+
+    // 将非空的延迟直方图写入日志
+    void DumpLatencyStats();
     
   private:
     friend class RDMAClient;
     friend class RDMAServer;
+    friend class RDMAReactor;
 
-    struct RecvBuffer {
-        RecvBuffer() : buffer(nullptr), sz(0) {}
-        RecvBuffer(char* buffer_, uint32_t sz_) : buffer(buffer_), sz(sz_) {}
-        char* buffer;
-        size_t sz;
-    };
-    // 开启WaitDisconnected()，并当keep_ec为true时将rmda_cm_id托管至新的event channel
+    // 开启WaitDisconnected()，并当keep_ec为true时将rmda_cm_id托管至新的event channel；
+    // reactor模式下则托管至reactor的event channel，keep_ec为true时原event channel被销毁
     int Detach(bool keep_ec);
 
     // 处理CQE
@@ -100,26 +375,285 @@ class RDMAProxy {
     // 处理CQ中的完成事件
     void PollCQ();
 
+    // 交替地批量轮询两个CQ直至均为空或用尽poll_budget，返回处理的完成事件数量
+    int DrainCQ();
+
+    // 一批完成事件处理后，批量释放发送缓冲区并一次性唤醒接收方
+    void FinishBatch();
+
+    // 重新使能CQ的通知并阻塞等待completion channel，被唤醒或超时后返回
+    void WaitCompletionEvent();
+
     // 等待来自对端或本地的关闭请求
     void WaitDisconnected();
 
-    // 提交一条接受指令
-    int PostRecv();
+    // 将QP转入错误状态并在两个队列末尾各提交一个标记WR，阻塞至reactor取回二者；
+    // 冲刷按队列顺序完成，此后共享CQ上不再有属于本连接的完成事件
+    void DrainQP();
+
+    // 提交一条接受指令，描述符及其缓冲区槽被重复使用
+    int PostRecv(RecvDesc* desc);
+
+    // 将descs串联为一条WR链提交，返回-1时所有描述符保持未提交
+    int PostRecvChain(RecvDesc** descs, size_t n);
+
+    // 完成线程中暂存待重新提交的接收描述符，在一轮轮询结束后由FlushRecv统一提交
+    inline void RepostRecv(RecvDesc* desc) {
+        if (!closing) recv_batch_.push_back(desc);
+    }
+
+    void FlushRecv();
+
+    // 填充rdma_connect/rdma_accept的参数，request为被动端收到的连接请求参数
+    void FillConnParam(const rdma_conn_param* request, rdma_conn_param* param);
+
+    // 记录对端通过private_data交换的ConnInfo
+    void SetPeerInfo(const void* private_data, uint8_t len);
+
+    // 单个分片可携带的最大负载
+    inline uint32_t MaxFragment() const { return peer_slot_size_ - sizeof(MsgHeader); }
+
+    // 获取Send描述符并在池为空时计数，wait为true时阻塞直至获取成功，连接关闭时返回nullptr
+    SendDesc* AcquireSendDesc(bool wait);
+
+    // 只预留发送缓冲区而不占用Send描述符，描述符由提交时获取，失败时返回-1
+    int ReserveSendBuffer(uint32_t sz, SendBuffer* buffer);
+
+    inline SendDesc* WaitSendDesc() { return AcquireSendDesc(true); }
+
+    inline void CountSent(uint32_t len) {
+        msgs_sent_.fetch_add(1, std::memory_order_relaxed);
+        bytes_sent_.fetch_add(len, std::memory_order_relaxed);
+    }
+
+    // 获取一个对端接收请求的credit，wait为false或连接关闭时获取失败返回false；
+    // 最后一个credit仅供Credit帧使用，保证双方总能归还credit
+    bool AcquireCredit(bool wait, bool update);
+
+    // 待归还的credit达到阈值时发送Credit帧
+    void ReturnCredits();
+
+    // 是否有尚未完成的SEND或等待对端READ的缓冲区，即发送缓冲区是否可能被释放
+    bool SendPending();
+
+    // 等待ready返回true：先空转SENDSPINCOUNT次，再阻塞至完成线程唤醒；连接关闭时返回false
+    bool WaitSend(const std::function<bool()>& ready);
+
+    // 唤醒阻塞在WaitSend中的发送方，无发送方阻塞时不加锁
+    void NotifySend();
+
+    // 不经过发送内存区域，将data以单个内联帧提交
+    int SendInline(const char* data, uint32_t len, SendCallback cb);
+
+    // 将desc关联到frame的前len字节，不超过内联上限时设置IBV_SEND_INLINE
+    void FillFrame(SendDesc* desc, char* frame, uint32_t len);
+
+    // 将desc关联到frame的前len字节并提交
+    int PostFrame(SendDesc* desc, char* frame, uint32_t len);
+
+    // 将descs串联为一条WR链提交，返回成功提交的数量，其余描述符由调用方回收；
+    // 仅部分WR请求完成通知，已提交的描述符按提交顺序记录于send_ring_；
+    // 内联帧在提交后立即释放
+    size_t PostSendChain(SendDesc** descs, size_t n);
+
+    // 与PostSendChain相同，调用方已持有send_mtx_
+    size_t PostSendChainLocked(SendDesc** descs, size_t n);
+
+    // 收到last的完成事件时，RC的顺序保证其之前未请求通知的WR均已完成，一并回收；
+    // status为last的完成状态
+    void ReclaimSends(SendDesc* last, ibv_wc_status status);
+
+    // 将data拆分为多个分片依次提交，cb关联至最后一个分片
+    int SendFragments(const char* data, uint32_t len, SendCallback cb);
+
+    // 将位于发送内存区域的frame交由对端READ，完成前frame不被释放
+    int SendRendezvous(char* frame, uint32_t len, SendCallback cb);
+
+    // desc完成时调用cb
+    inline void SetSendCallback(SendDesc* desc, SendCallback cb) {
+        send_callbacks_[WrIndexOf(desc->wr.wr_id)] = std::move(cb);
+    }
+
+    // 发送方：消息能否以单个记录写入对端的接收环
+    inline bool RingFits(uint32_t len) const {
+        return peer_ring_size_ > 0 && sizeof(MsgHeader) + len <= peer_ring_size_ / 4;
+    }
+
+    // 发送方：desc关联完整的Data帧且对端接收环有空间时，为其分配位置并改为RDMA WRITE_WITH_IMM，
+    // 立即数为记录在环中的偏移/8；调用方持有send_mtx_
+    bool RingReserve(SendDesc* desc);
+
+    // 发送方：将超过单个分片的消息以单个记录写入对端接收环，未提交时返回-1，frame与cb仍归调用方
+    int SendRing(char* frame, uint32_t len, SendCallback& cb);
+
+    // 接收方：解析写入接收环的记录
+    void HandleRingRecord(RecvDesc* desc, uint32_t imm, uint32_t byte_len);
+
+    // 接收方：归还借出的记录，已消费的位置累计达到环的1/4时写回对端
+    void ReleaseRingRecord(const char* data);
+
+    // 接收方：将已消费的接收环位置写入对端的head_addr
+    void ReportRingHead();
+
+    // 提交单边操作
+    int PostOneSided(ibv_wr_opcode opcode, ibv_mr* mr, size_t offset, uint32_t len,
+                     const RemoteRegion& remote, uint64_t remote_offset, SendCallback cb);
+
+    // 提交原子操作，结果槽在回调后释放
+    int PostAtomic(ibv_wr_opcode opcode, const RemoteRegion& remote, uint64_t remote_offset,
+                   uint64_t compare_add, uint64_t swap, AtomicCallback cb);
+
+    // 提交控制帧，wait为false且暂无可用描述符时返回-1
+    int PostControl(FrameType type, uint32_t msg_id, const void* payload, uint32_t len, bool wait);
+
+    // 解析接收到的帧
+    void HandleFrame(RecvDesc* desc, uint32_t byte_len);
+
+    // 暂存完整的消息，在FinishBatch中统一放入接受队列
+    inline void EnqueueRecv(RecvBuffer buffer) {
+        if (latency_) buffer.complete_ns = MonotonicNs();
+        msgs_received_.fetch_add(1, std::memory_order_relaxed);
+        bytes_received_.fetch_add(buffer.len, std::memory_order_relaxed);
+        recv_ready_.push_back(buffer);
+    }
+
+    // 由完成线程将buffer放入接受队列，无锁队列已满时放入后备队列
+    void PushRecv(const RecvBuffer& buffer);
+
+    // 非阻塞地取出一条消息并记录其接收延迟，队列为空时返回false
+    bool PopRecv(RecvBuffer* buffer);
+
+    bool TakeRecv(RecvBuffer* buffer);
+
+    // 空转后阻塞地取出一条消息，连接关闭且队列为空或等待超过timeout_us时返回false，timeout_us为0时不限时
+    bool WaitRecv(RecvBuffer* buffer, uint32_t timeout_us = 0);
+
+    // 回收Send描述符及其发送缓冲区
+    void RecycleSendDesc(SendDesc* desc);
+
+    // 提交完成线程中因描述符不足而暂存的READ与控制帧
+    void FlushDeferred();
 
     std::atomic<bool> closing{false}; // 连接是否被关闭
     std::unique_ptr<RDMAProxyContext> context_; // RDMA verbs所需的句柄集合
     std::thread poll_cq_thread;
     std::thread wait_disconnected_thread;
 
+    // 接受队列，保存尚未被取走的接收缓冲区；完成线程写入，任意线程取出
+    BoundedQueue<RecvBuffer> recv_msg_queue_;
+    // 无锁队列满时的后备队列，其中的消息均晚于无锁队列中的消息
+    std::mutex overflow_mtx_;
+    std::deque<RecvBuffer> recv_overflow_;
+    std::atomic<bool> overflowed_{false};
+
+    // 仅在接收方阻塞时使用，完成线程在parked_大于0时才加锁唤醒
     std::mutex mtx_;
     std::condition_variable cv_;
+    std::atomic<int> parked_{0};
 
-    std::atomic<uint64_t> request_id_{0}; // 当前的WQE id
-
-    std::queue<std::string> recv_msg_queue_; //接受队列
-    std::unordered_map<uint64_t, RecvBuffer> recv_buffers_;  // 保存接受请求的<wr_id : 缓冲区地址及长度>
+    // 发送方等待描述符、credit或发送缓冲区时使用，唤醒方式同上
+    std::mutex send_wait_mtx_;
+    std::condition_variable send_cv_;
+    std::atomic<int> send_parked_{0};
 
     std::atomic<uint64_t> in_flight_tasks_{0}; // 目前被提交但未被确认的WQE数量
+    std::atomic<uint32_t> drain_markers_{0};   // DrainQP()提交后尚未取回的标记WR数量
+    std::atomic<uint32_t> dispatching_{0};     // reactor轮询线程在worker锁外处理本连接的批次时非零
+    std::atomic<uint64_t> recvs_posted_{0};    // 其中的接收请求数量
+
+    // 运行计数，见ProxyStats
+    std::atomic<uint64_t> msgs_sent_{0};
+    std::atomic<uint64_t> bytes_sent_{0};
+    std::atomic<uint64_t> msgs_received_{0};
+    std::atomic<uint64_t> bytes_received_{0};
+    std::atomic<uint64_t> post_failures_{0};
+    std::atomic<uint64_t> send_desc_stalls_{0};
+    std::atomic<uint64_t> send_buffer_stalls_{0};
+    std::atomic<uint64_t> credit_stalls_{0};
+
+    // 完成线程的统计，仅由完成线程写入
+    std::atomic<uint64_t> polls_{0};
+    std::atomic<uint64_t> empty_polls_{0};
+    std::atomic<uint64_t> completions_{0};
+    std::atomic<uint64_t> sleeps_{0};
+    std::atomic<uint64_t> wakeups_{0};
+    std::chrono::steady_clock::time_point poll_start_;
+    std::unique_ptr<LatencyHistogram[]> latency_;  // 以LatencyKind索引，未开启latency_stats时为nullptr
+    std::unique_ptr<uint64_t[]> send_post_ns_;     // 以Send描述符的序号索引的提交时刻
+    uint64_t last_dump_ns_{0};
+    std::atomic<uint64_t> poll_wall_ns_{0};  // 完成线程退出后记录其运行时间
+    std::atomic<uint64_t> poll_cpu_ns_{0};   // 完成线程退出后记录其CPU时间
+
+    ConnInfo local_info_;                    // 通过private_data发送给对端
+    std::atomic<int32_t> send_credits_{0};   // 对端尚可接收的SEND数量
+    std::atomic<uint32_t> credits_to_return_{0}; // 已重新提交但尚未告知对端的接收请求数量
+    uint32_t credit_threshold_{1};           // 无帧可捎带时，待归还的credit达到该值则发送Credit帧
+    uint32_t peer_slot_size_{RECVBUFFERSIZE}; // 对端接收缓冲区槽的大小
+    std::atomic<uint32_t> next_msg_id_{0};
+
+    // 以下状态仅由完成线程访问
+    struct Reassembly {
+        char* addr;         // 位于接收内存区域，为nullptr时表示丢弃该消息
+        uint32_t received;
+    };
+    struct PendingRead {
+        uint32_t msg_id;
+        RendezvousInfo info;
+        char* dest;
+    };
+    std::unordered_map<uint32_t, Reassembly> reassembly_; // 正在重组的分片消息
+    std::deque<PendingRead> pending_reads_;
+    std::deque<uint32_t> pending_done_;
+    std::vector<RecvDesc*> recv_batch_;
+    std::vector<ibv_wc> wc_;                 // ibv_poll_cq的输出数组
+    std::vector<RecvBuffer> recv_ready_;     // 本批次中收到的完整消息
+    std::vector<char*> send_release_;        // 本批次中可释放的发送缓冲区
+    std::vector<std::pair<SendCallback, ibv_wc_status>> send_done_; // 本批次中完成的异步发送
+
+    // 按提交顺序记录已提交的Send描述符，由send_mtx_保护的提交方写入，完成线程读取
+    std::mutex send_mtx_;
+    std::unique_ptr<SendDesc*[]> send_ring_;
+    size_t send_ring_mask_{0};
+    std::atomic<size_t> send_head_{0};
+    std::atomic<size_t> send_tail_{0};
+    uint32_t unsignaled_{0};  // 自上一个请求通知的WR以来提交的WR数量
+    std::vector<char*> send_inlined_;  // PostSendChain中摘下的内联帧
+    std::unique_ptr<SendCallback[]> send_callbacks_;  // 以Send描述符的序号索引，提交前写入，回收时取出
+
+    std::mutex region_mtx_;
+    std::condition_variable region_cv_;
+    std::unordered_map<uint32_t, RemoteRegion> remote_regions_; // 对端公开的内存区域
+    std::vector<ibv_mr*> local_mrs_;                            // RegisterMemory注册的MR
+
+    // 接收环，接收方视角；位置均为单调递增的字节数
+    struct RingRecord {
+        uint64_t begin;
+        uint64_t end;
+        bool released;
+    };
+    char* ring_{nullptr};
+    uint32_t ring_size_{0};
+    uint64_t* ring_head_out_{nullptr};  // 写回对端的已消费位置的源缓冲区
+    std::mutex ring_mtx_;
+    std::deque<RingRecord> ring_records_;  // 按写入顺序排列的未归还记录
+    uint64_t ring_tail_{0};                // 已收到的记录的末尾
+    std::atomic<uint64_t> ring_head_{0};   // 已归还的连续记录的末尾
+    std::atomic<uint64_t> ring_reported_{0}; // 最近一次写回对端的位置
+    // 对端的接收环，发送方视角，peer_ring_tail_由send_mtx_保护
+    uint64_t* ring_head_in_{nullptr};   // 对端写入其已消费的位置，位于接收内存区域
+    uint64_t peer_ring_addr_{0};
+    uint32_t peer_ring_size_{0};
+    uint32_t peer_ring_rkey_{0};
+    uint64_t peer_head_addr_{0};
+    uint32_t peer_head_rkey_{0};
+    uint64_t peer_ring_tail_{0};
+
+    std::mutex rendezvous_mtx_;
+    struct PendingRendezvous {
+        char* frame;
+        SendCallback cb;
+    };
+    std::unordered_map<uint32_t, PendingRendezvous> rendezvous_; // 等待对端READ的发送缓冲区
 };
 
 }
@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "rdma_reactor.h"
+
+namespace RDMA_ECHO {
+
+RDMAReactor::RDMAReactor(std::shared_ptr<FileLogger> logger, const RDMAReactorOptions& options)
+    : logger_(logger), options_(options) {
+    for (uint32_t i = 0; i < std::max<uint32_t>(options_.threads, 1); i++) {
+        workers_.push_back(std::unique_ptr<Worker>(new Worker()));
+    }
+}
+
+RDMAReactor::~RDMAReactor() {
+    stop_ = true;
+    if (event_thread_.joinable()) {
+        event_thread_.join();
+    }
+    for (auto& worker : workers_) {
+        if (worker->thread.joinable()) {
+            worker->thread.join();
+        }
+        if (worker->cq != nullptr && ibv_destroy_cq(worker->cq)) {
+            Log(logger_.get(), "~RDMAReactor() ibv_destroy_cq Fail(%s)", strerror(errno));
+        }
+        if (worker->channel != nullptr && ibv_destroy_comp_channel(worker->channel)) {
+            Log(logger_.get(), "~RDMAReactor() ibv_destroy_comp_channel Fail(%s)", strerror(errno));
+        }
+    }
+    if (ec_ != nullptr) {
+        rdma_destroy_event_channel(ec_);
+    }
+    Log(logger_.get(), "~RDMAReactor() Done");
+}
+
+int RDMAReactor::Start() {
+    if ((ec_ = rdma_create_event_channel()) == nullptr) {
+        Log(logger_.get(), "RDMAReactor Start: create_event_channel Fail(%s)", strerror(errno));
+        return -1;
+    }
+    event_thread_ = std::thread(&RDMAReactor::WaitEvents, this);
+    Log(logger_.get(), "RDMAReactor Start, %lu workers", workers_.size());
+    return 0;
+}
+
+int RDMAReactor::InitWorker(size_t idx, ibv_context* verbs) {
+    Worker* worker = workers_[idx].get();
+    if (options_.completion_mode != CompletionMode::BusyPoll &&
+        (worker->channel = ibv_create_comp_channel(verbs)) == nullptr) {
+        Log(logger_.get(), "RDMAReactor ibv_create_comp_channel Fail(%s)", strerror(errno));
+        return -1;
+    }
+    if ((worker->cq = ibv_create_cq(verbs, options_.cq_size, nullptr, worker->channel, 0)) == nullptr) {
+        Log(logger_.get(), "RDMAReactor create cq Fail(%s)", strerror(errno));
+        if (worker->channel != nullptr) {
+            ibv_destroy_comp_channel(worker->channel);
+            worker->channel = nullptr;
+        }
+        return -1;
+    }
+    worker->verbs = verbs;
+    worker->thread = std::thread(&RDMAReactor::PollWorker, this, idx);
+    if (options_.pin_threads) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(idx % std::max<unsigned>(std::thread::hardware_concurrency(), 1), &cpus);
+        if (pthread_setaffinity_np(worker->thread.native_handle(), sizeof(cpus), &cpus)) {
+            Log(logger_.get(), "RDMAReactor pin worker %lu Fail", idx);
+        }
+    }
+    return 0;
+}
+
+ibv_cq* RDMAReactor::AttachCQ(ibv_context* verbs, int cqe) {
+    std::unique_lock<std::mutex> lock(attach_mtx_);
+    // 优先选择已初始化且负载最小的worker，全部已满时初始化新的worker
+    Worker* best = nullptr;
+    size_t fresh = workers_.size();
+    for (size_t i = 0; i < workers_.size(); i++) {
+        Worker* worker = workers_[i].get();
+        if (worker->cq == nullptr) {
+            if (fresh == workers_.size()) fresh = i;
+            continue;
+        }
+        if (worker->verbs != verbs || worker->reserved_cqe + cqe > options_.cq_size) {
+            continue;
+        }
+        if (best == nullptr || worker->reserved_cqe < best->reserved_cqe) {
+            best = worker;
+        }
+    }
+    if (fresh < workers_.size() && (best == nullptr || best->reserved_cqe > 0)) {
+        if (cqe <= options_.cq_size && InitWorker(fresh, verbs) == 0) {
+            best = workers_[fresh].get();
+        }
+    }
+    if (best == nullptr) {
+        Log(logger_.get(), "RDMAReactor AttachCQ(%d) Fail, no capacity", cqe);
+        return nullptr;
+    }
+    best->reserved_cqe += cqe;
+    return best->cq;
+}
+
+void RDMAReactor::DetachCQ(ibv_cq* cq, int cqe) {
+    std::unique_lock<std::mutex> lock(attach_mtx_);
+    Worker* worker = FindWorker(cq);
+    if (worker != nullptr) {
+        worker->reserved_cqe -= cqe;
+    }
+}
+
+RDMAReactor::Worker* RDMAReactor::FindWorker(ibv_cq* cq) {
+    for (auto& worker : workers_) {
+        if (worker->cq == cq) {
+            return worker.get();
+        }
+    }
+    return nullptr;
+}
+
+void RDMAReactor::Register(RDMAProxy* proxy) {
+    Worker* worker;
+    {
+        std::unique_lock<std::mutex> lock(attach_mtx_);
+        worker = FindWorker(proxy->context_->send_complete_queue);
+    }
+    std::unique_lock<std::mutex> lock(worker->mtx);
+    worker->proxies[proxy->context_->rdma_id->qp->qp_num] = proxy;
+}
+
+int RDMAReactor::Watch(RDMAProxy* proxy) {
+    rdma_cm_id* id = proxy->context_->rdma_id;
+    {
+        std::unique_lock<std::mutex> lock(event_mtx_);
+        watched_[id] = proxy;
+    }
+    if (rdma_migrate_id(id, ec_)) {
+        Log(logger_.get(), "RDMAReactor Watch: rdma_migrate_id Fail(%s)", strerror(errno));
+        std::unique_lock<std::mutex> lock(event_mtx_);
+        watched_.erase(id);
+        return -1;
+    }
+    return 0;
+}
+
+void RDMAReactor::Unregister(RDMAProxy* proxy) {
+    {
+        std::unique_lock<std::mutex> lock(event_mtx_);
+        watched_.erase(proxy->context_->rdma_id);
+    }
+    Worker* worker;
+    {
+        std::unique_lock<std::mutex> lock(attach_mtx_);
+        worker = FindWorker(proxy->context_->send_complete_queue);
+    }
+    if (worker == nullptr) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(worker->mtx);
+        worker->proxies.erase(proxy->context_->rdma_id->qp->qp_num);
+    }
+    // 移出索引后不会再被取出，但可能仍有一个已取出的批次在锁外执行回调
+    while (proxy->dispatching_.load() > 0) {
+        std::this_thread::yield();
+    }
+}
+
+int RDMAReactor::DrainWorker(Worker* worker, std::vector<ibv_wc>& wc, std::vector<RDMAProxy*>& touched) {
+    int n = ibv_poll_cq(worker->cq, wc.size(), wc.data());
+    if (n <= 0) {
+        if (n < 0) Log(logger_.get(), "RDMAReactor ibv_poll_cq Fail");
+        return 0;
+    }
+    {
+        std::unique_lock<std::mutex> lock(worker->mtx);
+        for (int i = 0; i < n; i++) {
+            auto it = worker->proxies.find(wc[i].qp_num);
+            if (it == worker->proxies.end()) {
+                // 已注销连接的冲刷事件
+                continue;
+            }
+            RDMAProxy* proxy = it->second;
+            proxy->HandleWorkComplete(&wc[i]);
+            proxy->completions_.fetch_add(1, std::memory_order_relaxed);
+            if (std::find(touched.begin(), touched.end(), proxy) == touched.end()) {
+                proxy->dispatching_.fetch_add(1);
+                touched.push_back(proxy);
+            }
+        }
+    }
+    // 与独立完成线程相同，每批结束后统一唤醒接收方并重新提交接收请求；
+    // 用户回调在此执行，须在锁外进行，以免阻塞其他连接的注册与注销
+    for (RDMAProxy* proxy : touched) {
+        proxy->polls_.fetch_add(1, std::memory_order_relaxed);
+        proxy->FinishBatch();
+        proxy->FlushRecv();
+        proxy->FlushDeferred();
+        proxy->dispatching_.fetch_sub(1);
+    }
+    touched.clear();
+    return n;
+}
+
+void RDMAReactor::PollWorker(size_t idx) {
+    Worker* worker = workers_[idx].get();
+    std::vector<ibv_wc> wc(std::max<uint32_t>(options_.poll_batch, 1));
+    std::vector<RDMAProxy*> touched;
+    auto spin = std::chrono::microseconds(options_.spin_us);
+    auto idle_start = std::chrono::steady_clock::now();
+    while (!stop_) {
+        if (DrainWorker(worker, wc, touched) > 0 || options_.completion_mode == CompletionMode::BusyPoll) {
+            idle_start = std::chrono::steady_clock::now();
+            continue;
+        }
+        if (options_.completion_mode == CompletionMode::Hybrid &&
+            std::chrono::steady_clock::now() - idle_start < spin) {
+            continue;
+        }
+        if (ibv_req_notify_cq(worker->cq, 0)) {
+            Log(logger_.get(), "RDMAReactor ibv_req_notify_cq Fail(%s)", strerror(errno));
+            continue;
+        }
+        // 使能通知前到达的完成事件不会触发通知，需再轮询一次
+        if (DrainWorker(worker, wc, touched) > 0) {
+            continue;
+        }
+        pollfd pfd;
+        pfd.fd = worker->channel->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) > 0) {
+            ibv_cq* cq = nullptr;
+            void* cq_context = nullptr;
+            if (ibv_get_cq_event(worker->channel, &cq, &cq_context) == 0) {
+                ibv_ack_cq_events(cq, 1);
+            }
+        }
+        idle_start = std::chrono::steady_clock::now();
+    }
+    Log(logger_.get(), "RDMAReactor worker %lu Exit", idx);
+}
+
+void RDMAReactor::WaitEvents() {
+    while (!stop_) {
+        // 以超时等待，使析构时能够退出
+        pollfd pfd;
+        pfd.fd = ec_->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+        struct rdma_cm_event *event = nullptr;
+        if (rdma_get_cm_event(ec_, &event)) {
+            Log(logger_.get(), "RDMAReactor get event Fail(%s)", strerror(errno));
+            continue;
+        }
+        {
+            std::unique_lock<std::mutex> lock(event_mtx_);
+            auto it = watched_.find(event->id);
+            if (it != watched_.end() && event->event == RDMA_CM_EVENT_DISCONNECTED) {
+                it->second->closing = true;
+                Log(logger_.get(), "RDMAProxy Disconnected");
+            } else {
+                Log(logger_.get(), "RDMAReactor ignore event %d", event->event);
+            }
+        }
+        rdma_ack_cm_event(event);
+    }
+    Log(logger_.get(), "RDMAReactor WaitEvents() Exit");
+}
+
+}
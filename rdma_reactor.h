@@ -0,0 +1,93 @@
+#ifndef RDMA_RDMA_REACTOR_H
+#define RDMA_RDMA_REACTOR_H
+
+#include <rdma/rdma_cma.h>
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "logger.h"
+#include "rdma_proxy.h"
+
+namespace RDMA_ECHO {
+
+// RDMAReactor的可配置项
+struct RDMAReactorOptions {
+    uint32_t threads{1};       // 轮询线程数量，通常不超过核数
+    bool pin_threads{false};   // 第i个轮询线程绑定至第i个核
+    int cq_size{4096};         // 每个轮询线程的共享CQ容量，决定其最多可服务的连接数
+    CompletionMode completion_mode{CompletionMode::Hybrid};
+    uint32_t spin_us{50};      // Hybrid模式下转为阻塞前的空轮询时间
+    uint32_t poll_batch{16};   // 每次ibv_poll_cq最多取回的完成事件数量
+};
+
+// 由多个RDMAProxy共享的完成事件与断开事件处理线程。
+// 每个轮询线程持有一个共享CQ，其上所有QP的完成事件按qp_num分发至所属的RDMAProxy；
+// 所有连接的rdma_cm_id托管至同一个event channel，由一个线程等待断开事件。
+// 须在所有使用它的RDMAProxy析构后才析构，RDMAProxyOptions::reactor持有其shared_ptr以保证这一点
+class RDMAReactor {
+  public:
+    RDMAReactor(std::shared_ptr<FileLogger> logger, const RDMAReactorOptions& options = RDMAReactorOptions());
+    ~RDMAReactor();
+
+    // 创建event channel并开启断开事件线程，失败时返回-1
+    int Start();
+
+    // 为需要cqe个CQE的QP选择负载最小的轮询线程并返回其共享CQ，容量不足时返回nullptr；
+    // 共享CQ只在reactor析构时销毁，使用方销毁QP前须从rdma_cm_id上解除其登记，以免rdma_destroy_qp将其销毁
+    ibv_cq* AttachCQ(ibv_context* verbs, int cqe);
+
+    // 归还AttachCQ预留的CQE
+    void DetachCQ(ibv_cq* cq, int cqe);
+
+    // 开始向proxy分发其QP上的完成事件，须在提交任何WR之前调用
+    void Register(RDMAProxy* proxy);
+
+    // 将proxy的rdma_cm_id托管至共享的event channel，失败时返回-1
+    int Watch(RDMAProxy* proxy);
+
+    // 停止向proxy分发任何事件，返回后不会再调用proxy的方法；不可在轮询线程执行的回调中调用
+    void Unregister(RDMAProxy* proxy);
+
+  private:
+    struct Worker {
+        std::mutex mtx;
+        ibv_context* verbs{nullptr};
+        ibv_comp_channel* channel{nullptr};
+        ibv_cq* cq{nullptr};
+        int reserved_cqe{0};
+        std::unordered_map<uint32_t, RDMAProxy*> proxies; // 以qp_num索引
+        std::thread thread;
+    };
+
+    // 创建worker的共享CQ并开启其轮询线程
+    int InitWorker(size_t idx, ibv_context* verbs);
+
+    Worker* FindWorker(ibv_cq* cq);
+
+    // 轮询worker的共享CQ并分发完成事件
+    void PollWorker(size_t idx);
+
+    // 轮询一次共享CQ，返回处理的完成事件数量
+    int DrainWorker(Worker* worker, std::vector<ibv_wc>& wc, std::vector<RDMAProxy*>& touched);
+
+    // 等待所有连接的断开事件
+    void WaitEvents();
+
+    std::shared_ptr<FileLogger> logger_;
+    RDMAReactorOptions options_;
+    std::atomic<bool> stop_{false};
+    std::mutex attach_mtx_;  // 保护各worker的初始化与reserved_cqe
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    rdma_event_channel* ec_{nullptr};
+    std::thread event_thread_;
+    std::mutex event_mtx_;
+    std::unordered_map<rdma_cm_id*, RDMAProxy*> watched_;
+};
+
+}
+#endif
@@ -2,25 +2,52 @@
 #define RDMA_SERVER_H
 
 #include <memory>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <unordered_map>
 #include <netdb.h>
+#include <poll.h>
 
 #include "logger.h"
 #include "rdma_proxy.h"
 
 namespace RDMA_ECHO {
- 
+
+// 接收已建立的连接，可能由多个建连线程并发调用
+using AcceptCallback = std::function<void(std::unique_ptr<RDMAProxy>)>;
 
 class RDMAServer {
   public:
-    RDMAServer(const std::string& logger_file) {
+    RDMAServer(const std::string& logger_file, const RDMAProxyOptions& options = RDMAProxyOptions())
+            : options_(options) {
         std::FILE* f = std::fopen(logger_file.c_str(), "w");
         TEST(f != nullptr);
-        logger_ = std::make_shared<FileLogger>(f, true);
+        logger_ = std::make_shared<FileLogger>(f, options.log_terminal, options.async_log);
     }
     ~RDMAServer() {
+        stop_ = true;
+        if (event_thread_.joinable()) {
+            event_thread_.join();
+        }
+        task_cv_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        // 尚未建立的连接仍使用ec_，须在其之前销毁
+        pending_.clear();
+        ready_.clear();
+        if (listener_ != nullptr) {
+            rdma_destroy_id(listener_);
+        }
         rdma_destroy_event_channel(ec_);
     }
-    int BindAndListen(uint64_t port) {
+    // backlog为rdma_listen中尚未被处理的连接请求的上限
+    int BindAndListen(uint64_t port, int backlog = 10) {
         struct sockaddr_in addr;
         memset(&addr, 0, sizeof(addr));
         addr.sin_family = AF_INET;
@@ -39,25 +66,60 @@ class RDMAServer {
             Log(logger_.get(), "rdma_bind_addr in port:%d Fail", port, strerror(errno));
             return -1;
         }
-        if (rdma_listen(listener_, 10)) {
+        if (rdma_listen(listener_, backlog)) {
             Log(logger_.get(), "rdma_listen in port:%d Fail", port, strerror(errno));
             return -1;
         }
         Log(logger_.get(), "RDMAServer BindAndListen Success");
         return 0;
     }
+    // 开启事件循环线程与workers个建连线程，并发地处理多个连接的建立，须在BindAndListen之后调用；
+    // 建立的连接交给cb，cb为nullptr时放入队列，由Accept()取出
+    int StartAcceptor(uint32_t workers, AcceptCallback cb = nullptr) {
+        if (ec_ == nullptr || event_thread_.joinable()) {
+            Log(logger_.get(), "RDMAServer StartAcceptor: not listening or already started");
+            return -1;
+        }
+        accept_cb_ = std::move(cb);
+        for (uint32_t i = 0; i < std::max<uint32_t>(workers, 1); i++) {
+            workers_.emplace_back(&RDMAServer::RunTasks, this);
+        }
+        event_thread_ = std::thread(&RDMAServer::HandleEvents, this);
+        Log(logger_.get(), "RDMAServer StartAcceptor, %u workers", workers);
+        return 0;
+    }
+    // 开启StartAcceptor后从队列中取出已建立的连接，否则串行地等待并建立一个连接；失败或服务器析构时返回nullptr
     std::unique_ptr<RDMAProxy> Accept() {
+        if (event_thread_.joinable()) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            while (ready_.empty()) {
+                if (stop_) {
+                    return nullptr;
+                }
+                ready_cv_.wait_for(lock, std::chrono::milliseconds(100));
+            }
+            std::unique_ptr<RDMAProxy> proxy = std::move(ready_.front());
+            ready_.pop_front();
+            return proxy;
+        }
         rdma_cm_id* conn = nullptr;
-        if (WaitListen(&conn)) {
+        rdma_conn_param request;
+        ConnInfo peer_info;
+        if (WaitListen(&conn, &request, &peer_info)) {
             Log(logger_.get(), "RDMAServer WaitListen Fail(%s)", strerror(errno));
             return nullptr;
         }
-        auto proxy = GenerateProxy(conn, logger_);
+        auto proxy = GenerateProxy(conn, logger_, options_);
         if (!proxy) {
             Log(logger_.get(), "GenerateProxy Fail(%s)", strerror(errno));
+            rdma_reject(conn, nullptr, 0);
+            rdma_destroy_id(conn);
             return nullptr;
         }
-        if (WaitAccept(conn)) {
+        // Detach前rdma_id仍使用监听的event channel
+        proxy->context_->shared_ec = true;
+        proxy->SetPeerInfo(&peer_info, sizeof(peer_info));
+        if (WaitAccept(conn, &request, proxy.get())) {
             Log(logger_.get(), "RDMAServer WaitAccept Fail(%s)", strerror(errno));
             return nullptr;
         }
@@ -68,7 +130,8 @@ class RDMAServer {
         return proxy;
     }
   private:
-    int WaitListen(rdma_cm_id** conn) {
+    // 获取连接请求，并在确认事件前拷贝其连接参数与对端的ConnInfo
+    int WaitListen(rdma_cm_id** conn, rdma_conn_param* request, ConnInfo* peer_info) {
         struct rdma_cm_event *event = nullptr;
         if (rdma_get_cm_event(ec_, &event)) {
             Log(logger_.get(), "RDMAServer Accepting: rdma_listen get event Fail(%s)", strerror(errno));
@@ -79,14 +142,15 @@ class RDMAServer {
             return -1;
         }
         *conn = event->id;
+        CopyRequest(event, request, peer_info);
         rdma_ack_cm_event(event);
         Log(logger_.get(), "RDMAServer Receive Connect Request");
         return 0;
     }
-    int WaitAccept(rdma_cm_id* conn) {
+    int WaitAccept(rdma_cm_id* conn, const rdma_conn_param* request, RDMAProxy* proxy) {
         struct rdma_cm_event *event = nullptr;
         struct rdma_conn_param cm_params;
-        memset(&cm_params, 0, sizeof(cm_params));
+        proxy->FillConnParam(request, &cm_params);
 
         if (rdma_accept(conn, &cm_params)) {
             Log(logger_.get(), "RDMAServer : rdma_accept Fail(%s)", strerror(errno));
@@ -104,9 +168,162 @@ class RDMAServer {
         Log(logger_.get(), "RDMAServer Accept Success");
         return 0;
     }
-    rdma_cm_id* listener_;
-    struct rdma_event_channel *ec_;
+    void CopyRequest(const rdma_cm_event* event, rdma_conn_param* request, ConnInfo* peer_info) {
+        *request = event->param.conn;
+        memset(peer_info, 0, sizeof(*peer_info));
+        if (request->private_data != nullptr) {
+            memcpy(peer_info, request->private_data, std::min<size_t>(request->private_data_len, sizeof(*peer_info)));
+        }
+        request->private_data = nullptr;
+        request->private_data_len = 0;
+    }
+
+    // 事件循环：事件均在确认后交由建连线程处理，rdma_accept、Detach与析构均可能阻塞
+    void HandleEvents() {
+        while (!stop_) {
+            pollfd pfd;
+            pfd.fd = ec_->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 100) <= 0) {
+                continue;
+            }
+            struct rdma_cm_event *event = nullptr;
+            if (rdma_get_cm_event(ec_, &event)) {
+                Log(logger_.get(), "RDMAServer get event Fail(%s)", strerror(errno));
+                continue;
+            }
+            rdma_cm_id* conn = event->id;
+            if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST) {
+                rdma_conn_param request;
+                ConnInfo peer_info;
+                CopyRequest(event, &request, &peer_info);
+                rdma_ack_cm_event(event);
+                Submit([this, conn, request, peer_info]() { SetupConnection(conn, request, peer_info); });
+                continue;
+            }
+            RDMAProxy* proxy = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                auto it = pending_.find(conn);
+                if (it != pending_.end()) {
+                    proxy = it->second.release();
+                    pending_.erase(it);
+                    if (event->event == RDMA_CM_EVENT_ESTABLISHED) {
+                        detaching_[conn] = proxy;
+                    }
+                } else if (event->event == RDMA_CM_EVENT_DISCONNECTED && detaching_.count(conn)) {
+                    // Detach迁移rdma_cm_id前已取出的断开事件，须在确认前标记，迁移在确认后才返回
+                    detaching_[conn]->closing = true;
+                }
+            }
+            int type = event->event;
+            rdma_ack_cm_event(event);
+            if (proxy == nullptr) {
+                Log(logger_.get(), "RDMAServer ignore event %d", type);
+            } else if (type == RDMA_CM_EVENT_ESTABLISHED) {
+                Submit([this, conn, proxy]() { HandOff(conn, std::unique_ptr<RDMAProxy>(proxy)); });
+            } else {
+                // REJECTED、CONNECT_ERROR、UNREACHABLE或建立前的DISCONNECTED
+                Log(logger_.get(), "RDMAServer connection Fail, event %d", type);
+                Submit([proxy]() { delete proxy; });
+            }
+        }
+        Log(logger_.get(), "RDMAServer HandleEvents() Exit");
+    }
+
+    // 创建RDMAProxy并rdma_accept，连接在ESTABLISHED后由HandOff交出
+    void SetupConnection(rdma_cm_id* conn, const rdma_conn_param& request, const ConnInfo& peer_info) {
+        auto proxy = GenerateProxy(conn, logger_, options_);
+        if (!proxy) {
+            // GenerateProxy失败时不销毁conn，也不触及监听的event channel
+            Log(logger_.get(), "GenerateProxy Fail(%s)", strerror(errno));
+            rdma_reject(conn, nullptr, 0);
+            rdma_destroy_id(conn);
+            return;
+        }
+        proxy->context_->shared_ec = true;
+        proxy->SetPeerInfo(&peer_info, sizeof(peer_info));
+        struct rdma_conn_param cm_params;
+        proxy->FillConnParam(&request, &cm_params);
+        {
+            // ESTABLISHED可能先于rdma_accept返回被事件循环取出
+            std::unique_lock<std::mutex> lock(mtx_);
+            pending_[conn] = std::move(proxy);
+        }
+        if (rdma_accept(conn, &cm_params)) {
+            Log(logger_.get(), "RDMAServer : rdma_accept Fail(%s)", strerror(errno));
+            std::unique_lock<std::mutex> lock(mtx_);
+            auto it = pending_.find(conn);
+            if (it != pending_.end()) {
+                proxy = std::move(it->second);
+                pending_.erase(it);
+            }
+        }
+    }
+
+    void HandOff(rdma_cm_id* conn, std::unique_ptr<RDMAProxy> proxy) {
+        int ret = proxy->Detach(false);
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            detaching_.erase(conn);
+        }
+        if (ret) {
+            Log(logger_.get(), "RDMAServer Accept: Detach Fail(%s)", strerror(errno));
+            return;
+        }
+        Log(logger_.get(), "RDMAServer Accept Success");
+        if (accept_cb_) {
+            accept_cb_(std::move(proxy));
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mtx_);
+        ready_.push_back(std::move(proxy));
+        ready_cv_.notify_one();
+    }
+
+    void Submit(std::function<void()> task) {
+        std::unique_lock<std::mutex> lock(task_mtx_);
+        tasks_.push_back(std::move(task));
+        task_cv_.notify_one();
+    }
+
+    // 建连线程，析构时处理完剩余的任务后退出
+    void RunTasks() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(task_mtx_);
+                while (tasks_.empty()) {
+                    if (stop_) {
+                        return;
+                    }
+                    task_cv_.wait_for(lock, std::chrono::milliseconds(100));
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    rdma_cm_id* listener_{nullptr};
+    struct rdma_event_channel *ec_{nullptr};
     std::shared_ptr<FileLogger> logger_;
+    RDMAProxyOptions options_;
+
+    std::atomic<bool> stop_{false};
+    AcceptCallback accept_cb_;
+    std::thread event_thread_;
+    std::vector<std::thread> workers_;
+    std::mutex task_mtx_;
+    std::condition_variable task_cv_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mtx_;
+    std::condition_variable ready_cv_;
+    std::unordered_map<rdma_cm_id*, std::unique_ptr<RDMAProxy>> pending_;  // 已rdma_accept，等待ESTABLISHED
+    std::unordered_map<rdma_cm_id*, RDMAProxy*> detaching_;                // 已建立，正在迁移rdma_cm_id
+    std::deque<std::unique_ptr<RDMAProxy>> ready_;                          // 未设置AcceptCallback时等待Accept()取出
 };
 
 